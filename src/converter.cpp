@@ -2,7 +2,7 @@
 
 namespace Converter
 {
-    int load(const QString &path, oct_subject** mySubject)
+    int load(const QString &path, oct_subject** mySubject, const oct_load_options &options)
     {
         if (path == "")
             return -1;
@@ -10,7 +10,7 @@ namespace Converter
         {
             try
             {
-                *mySubject = new oct_subject(path.toLocal8Bit().data());
+                *mySubject = new oct_subject(path.toLocal8Bit().data(), options);
                 if ((*mySubject)->scans.empty())
                     qDebug() << "No scans in this file." << endl;
             }
@@ -23,13 +23,13 @@ namespace Converter
         return 0;
     }
 
-    int save(const QString &path, oct_subject** mySubject, bool anonymize)
+    int save(const QString &path, oct_subject** mySubject, bool anonymize, bool compress)
     {
         try
         {
-            //uoctml
+            //uoctml, 2.0 with compressed slices if asked for
             if (path != "" && *mySubject != NULL)
-                save_uoctml(path.toLocal8Bit().data(), **mySubject, anonymize);
+                save_uoctml(path.toLocal8Bit().data(), **mySubject, anonymize, compress);
             else
                 return -1;
         }
@@ -41,7 +41,7 @@ namespace Converter
         return 0;
     }
 
-    void toUoctml(QStringList &inputPaths, QProgressDialog &progress, QPlainTextEdit &output, bool anonymized)
+    void toUoctml(QStringList &inputPaths, QProgressDialog &progress, QPlainTextEdit &output, bool anonymized, bool compress)
     {
         progress.setValue(0);
         oct_subject* mySubject = NULL;
@@ -122,7 +122,7 @@ namespace Converter
 
                     output.appendPlainText("Converting to uoctml... ");
                     output.moveCursor(QTextCursor::End);
-                    if ( save(saveFolder.absoluteFilePath(newFileName), &mySubject, anonymized) == -1) {
+                    if ( save(saveFolder.absoluteFilePath(newFileName), &mySubject, anonymized, compress) == -1) {
                         output.insertPlainText("failed");
                         output.moveCursor (QTextCursor::End);
                     }
@@ -148,51 +148,8 @@ namespace Converter
         output.appendPlainText("This Application can now be closed.");
     }
 
-    void calculateSectorValues(const oct_scan &m_scan, std::vector<double> &sectorValues, double &totalVolume, int contour_1, int contour_2)
+    void calculateSectorValues(const image_view<const float> &o1, const image_view<const float> &o2, const float size[3], std::size_t height, std::vector<double> &sectorValues, double &totalVolume)
     {
-        //find 2 contours of oct data to calculate their difference
-        int test = m_scan.contours.size();
-        if ((contour_1 >= test) || (contour_2 >= test)) {
-            qDebug() << "Not enough contours in the scan";
-            return;
-        }
-
-        std::map<std::string, image<float>>::const_iterator m_base;
-        std::map<std::string, image<float>>::const_iterator m_other;
-
-        //default
-        if (contour_1 < 0 && contour_2 < 0) {
-            m_base = m_scan.contours.begin();
-            m_other = m_scan.contours.end();
-            m_other--; //use last contour
-
-            //ignore NaN as last contour (found in E2E files)
-            //use center of image as example for validation
-            float test = m_other->second(m_other->second.width()/2,m_other->second.height()/2);
-            if (test != test)
-                m_other--;
-
-            if (m_base == m_other) {
-                qDebug() << "No Contour available";
-                return;
-            }
-        }
-        else if (contour_1 >= contour_2) {
-            qDebug() << "Contour 2 must be greater than Contour 1";
-            return;
-        }
-        else {
-            m_base = m_scan.contours.begin();
-            for (int i = 0; i < contour_1; ++i)
-                m_base++;
-            m_other = m_scan.contours.begin();
-            for (int i = 0; i < contour_2; ++i)
-                m_other++;
-        }
-
-        const image<float> &o1 = m_base->second;
-        const image<float> &o2 = m_other->second;
-
         size_t X = o1.width();
         size_t Y = o1.height();
         if (X != o2.width() || Y != o2.height())
@@ -200,26 +157,19 @@ namespace Converter
 
         //sector values
         double c = 0, no = 0, nr = 0, nl = 0, nu  = 0, fo = 0, fr = 0, fl = 0, fu = 0, t = 0, v = 0;
-        double m_aspect = m_scan.size[0] / m_scan.size[2];
-        double m_width_in_mm = m_scan.size[0];
-
-        std::unique_ptr<uint8_t []> depth(new uint8_t [X*Y]);
 
         size_t nc = 0, nno = 0, nnr = 0, nnl = 0, nnu = 0, nfo = 0, nfr = 0, nfl = 0, nfu = 0, n = 0;
         for (size_t y = 0; y != Y; ++y)
         {
           for (size_t x = 0; x != X; ++x)
           {
-            double d = std::abs(m_scan.size[1] / m_scan.tomogram.height() * (o2(x, y) - o1(x, y))); // thickness in mm
-            double mx = m_scan.size[0] * (2 * x + 1.0 - X) / 2 / X; // x-distance in mm
-            double my = m_scan.size[2] * (2 * y + 1.0 - Y) / 2 / Y; // y-distance in mm
+            double d = std::abs(size[1] / height * (o2(x, y) - o1(x, y))); // thickness in mm
+            double mx = size[0] * (2 * x + 1.0 - X) / 2 / X; // x-distance in mm
+            double my = size[2] * (2 * y + 1.0 - Y) / 2 / Y; // y-distance in mm
             double r2 = mx*mx + my*my; // square of distance
 
             if (d != d) // skip NaNs
-            {
-              depth[y*X+x] = 255;
               continue;
-            }
 
             // total volume
             if (r2 <= 9.0)
@@ -228,8 +178,6 @@ namespace Converter
               ++n;
             }
 
-            depth[y*X+x] = std::min(255.0 / 0.5 * d, 255.0);
-
             // sector thickness
             if (r2 <= 0.25)
             {
@@ -307,17 +255,60 @@ namespace Converter
         fr /= nfr;
         fl /= nfl;
         fu /= nfu;
-        v = t * m_scan.size[0] * m_scan.size[2] / X / Y;
+        v = t * size[0] * size[2] / X / Y;
         t /= n;
 
         sectorValues = std::vector<double>({c,no,nr,nl,nu,fo,fr,fl,fu});
         totalVolume = v;
     }
 
-    void calculateContourValues(const oct_scan &m_scan, std::vector<std::vector<double> > &contourValues)
+    void calculateSectorValues(const oct_scan &m_scan, std::vector<double> &sectorValues, double &totalVolume, int contour_1, int contour_2)
     {
-        std::map<std::string, image<float>>::const_iterator contour;
+        //find 2 contours of oct data to calculate their difference
+        int test = m_scan.contours.size();
+        if ((contour_1 >= test) || (contour_2 >= test)) {
+            qDebug() << "Not enough contours in the scan";
+            return;
+        }
+
+        std::map<std::string, image<float>>::const_iterator m_base;
+        std::map<std::string, image<float>>::const_iterator m_other;
+
+        //default
+        if (contour_1 < 0 && contour_2 < 0) {
+            m_base = m_scan.contours.begin();
+            m_other = m_scan.contours.end();
+            m_other--; //use last contour
+
+            //ignore NaN as last contour (found in E2E files)
+            //use center of image as example for validation
+            float test = m_other->second(m_other->second.width()/2,m_other->second.height()/2);
+            if (test != test)
+                m_other--;
 
+            if (m_base == m_other) {
+                qDebug() << "No Contour available";
+                return;
+            }
+        }
+        else if (contour_1 >= contour_2) {
+            qDebug() << "Contour 2 must be greater than Contour 1";
+            return;
+        }
+        else {
+            m_base = m_scan.contours.begin();
+            for (int i = 0; i < contour_1; ++i)
+                m_base++;
+            m_other = m_scan.contours.begin();
+            for (int i = 0; i < contour_2; ++i)
+                m_other++;
+        }
+
+        calculateSectorValues(view(m_base->second), view(m_other->second), m_scan.size, tomogram_height(m_scan), sectorValues, totalVolume);
+    }
+
+    void calculateContourValues(const oct_scan &m_scan, std::vector<std::vector<double> > &contourValues)
+    {
         for (auto contour = m_scan.contours.begin(); contour != m_scan.contours.end(); ++contour)
         {
             //ignore NaN
@@ -325,123 +316,12 @@ namespace Converter
             if (test != test)
                 continue;
 
-            const image<float> &o1 = contour->second;
-
-            size_t X = o1.width();
-            size_t Y = o1.height();
-
-            double c = 0, no = 0, nr = 0, nl = 0, nu  = 0, fo = 0, fr = 0, fl = 0, fu = 0, t = 0, v = 0;
-            double m_aspect = m_scan.size[0] / m_scan.size[2];
-            double m_width_in_mm = m_scan.size[0];
-
-            std::unique_ptr<uint8_t []> depth(new uint8_t [X*Y]);
-
-            size_t nc = 0, nno = 0, nnr = 0, nnl = 0, nnu = 0, nfo = 0, nfr = 0, nfl = 0, nfu = 0, n = 0;
-            for (size_t y = 0; y != Y; ++y)
-            {
-              for (size_t x = 0; x != X; ++x)
-              {
-                double d = std::abs(m_scan.size[1] / m_scan.tomogram.height() * (o1(x, y))); // thickness in mm
-                double mx = m_scan.size[0] * (2 * x + 1.0 - X) / 2 / X; // x-distance in mm
-                double my = m_scan.size[2] * (2 * y + 1.0 - Y) / 2 / Y; // y-distance in mm
-                double r2 = mx*mx + my*my; // square of distance
-
-                if (d != d) // skip NaNs
-                {
-                  depth[y*X+x] = 255;
-                  continue;
-                }
-
-                // total volume
-                if (r2 <= 9.0)
-                {
-                  t += d;
-                  ++n;
-                }
-
-                depth[y*X+x] = std::min(255.0 / 0.5 * d, 255.0);
-
-                // sector thickness
-                if (r2 <= 0.25)
-                {
-                  c += d;
-                  ++nc;
-                }
-                else if (r2 <= 2.25)
-                {
-                  if (mx <= my)
-                  {
-                    if (mx + my >= 0)
-                    {
-                      nu += d;
-                      ++nnu;
-                    }
-                    else
-                    {
-                      nl += d;
-                      ++nnl;
-                    }
-                  }
-                  else
-                  {
-                    if (mx + my >= 0)
-                    {
-                      nr += d;
-                      ++nnr;
-                    }
-                    else
-                    {
-                      no += d;
-                      ++nno;
-                    }
-                  }
-                }
-                else if (r2 <= 9.0)
-                {
-                  if (mx <= my)
-                  {
-                    if (mx + my >= 0)
-                    {
-                      fu += d;
-                      ++nfu;
-                    }
-                    else
-                    {
-                      fl += d;
-                      ++nfl;
-                    }
-                  }
-                  else
-                  {
-                    if (mx + my >= 0)
-                    {
-                      fr += d;
-                      ++nfr;
-                    }
-                    else
-                    {
-                      fo += d;
-                      ++nfo;
-                    }
-                  }
-                }
-              }
-            }
-
-            // average
-            c /= nc;
-            no /= nno;
-            nr /= nnr;
-            nl /= nnl;
-            nu /= nnu;
-            fo /= nfo;
-            fr /= nfr;
-            fl /= nfl;
-            fu /= nfu;
-            v = t * m_scan.size[0] * m_scan.size[2] / X / Y;
-            t /= n;
-
-            contourValues.push_back(std::vector<double>({c,no,nr,nl,nu,fo,fr,fl,fu}));
+            // thickness above zero, given as a contour with all-zero strides
+            const float zero = 0.0f;
+            std::vector<double> sectorValues;
+            double totalVolume;
+            calculateSectorValues(image_view<const float>(&zero, contour->second.width(), contour->second.height(), 0, 0), view(contour->second), m_scan.size, tomogram_height(m_scan), sectorValues, totalVolume);
+            contourValues.push_back(sectorValues);
         }
     }
 }
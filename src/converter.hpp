@@ -12,15 +12,20 @@
 
 #include "io/save_uoctml.hpp"
 #include "core/oct_data.hpp"
+#include "core/view.hpp"
 #include "xmlPatientList.hpp"
 
 namespace Converter{
-    extern int load(const QString &path, oct_subject** mySubject);
-    extern int save(const QString &path, oct_subject** mySubject, bool anonymize);
-    extern void toUoctml(QStringList &inputPaths, QProgressDialog &progress, QPlainTextEdit &output, bool anonymized = false);
+    //oct_payload::contours in options suffices for the sector and contour values
+    extern int load(const QString &path, oct_subject** mySubject, const oct_load_options &options = oct_load_options());
+    //compress writes UOCTML 2.0, which older readers reject
+    extern int save(const QString &path, oct_subject** mySubject, bool anonymize, bool compress = false);
+    extern void toUoctml(QStringList &inputPaths, QProgressDialog &progress, QPlainTextEdit &output, bool anonymized = false, bool compress = false);
     extern void toExcel(QStringList &inputPaths, QProgressDialog &progress, QPlainTextEdit &output, bool anonymized = false);
     //contour_1 starts at 0 (outer makula, nearest to oct-scanner)
     extern void calculateSectorValues(const oct_scan &m_scan, std::vector<double> &sectorValues, double &totalVolume, int contour_1 = -1, int contour_2 = -1);
+    //sector values of the thickness between two contours, given as views
+    extern void calculateSectorValues(const image_view<const float> &o1, const image_view<const float> &o2, const float size[3], std::size_t height, std::vector<double> &sectorValues, double &totalVolume);
     extern void calculateContourValues(const oct_scan &m_scan, std::vector<std::vector<double> > &contourValues);
 }
 
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2015 TU Chemnitz
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "allocator.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <string>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+  const size_t huge_page_size = 2 << 20;
+}
+
+void *allocate_data(size_t bytes)
+{
+  const size_t alignment = bytes >= huge_page_size ? huge_page_size : data_alignment;
+
+#ifdef _WIN32
+  void *p = _aligned_malloc(bytes ? bytes : 1, alignment);
+  if (!p)
+    throw bad_alloc();
+#else
+  void *p;
+  if (posix_memalign(&p, alignment, bytes ? bytes : 1) != 0)
+    throw bad_alloc();
+
+#ifdef MADV_HUGEPAGE
+  if (alignment == huge_page_size)
+    madvise(p, bytes / huge_page_size * huge_page_size, MADV_HUGEPAGE);
+#endif
+#endif
+
+  return p;
+}
+
+void free_data(void *p)
+{
+#ifdef _WIN32
+  _aligned_free(p);
+#else
+  free(p);
+#endif
+}
+
+size_t huge_page_bytes(const void *p, size_t bytes)
+{
+#ifdef __linux__
+  // sum up huge pages of all mappings overlapping the range
+  const uintptr_t begin = uintptr_t(p), end = begin + bytes;
+  ifstream smaps("/proc/self/smaps");
+  string line;
+  bool overlaps = false;
+  size_t result = 0;
+  while (getline(smaps, line))
+  {
+    istringstream is(line);
+    uintptr_t from, to;
+    char dash;
+    string key;
+    if (is >> hex >> from >> dash >> to && dash == '-')
+      overlaps = from < end && begin < to;
+    else if (overlaps && (is.clear(), is.seekg(0), is >> key) && key == "AnonHugePages:")
+    {
+      size_t kb;
+      if (is >> dec >> kb)
+        result += kb * 1024;
+    }
+  }
+
+  return result;
+#else
+  (void)p;
+  (void)bytes;
+  return 0;
+#endif
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright 2015 TU Chemnitz
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ALLOCATOR_HPP
+#define ALLOCATOR_HPP
+
+#include <cstddef>
+
+/// alignment of image and volume data in bytes
+const std::size_t data_alignment = 64;
+
+/// allocate memory for image or volume data
+/**
+ * Memory is aligned to data_alignment bytes. Large allocations are aligned
+ * to huge page boundaries and, on Linux, advised to be backed by transparent
+ * huge pages. Throws std::bad_alloc on failure.
+ */
+void *allocate_data(std::size_t bytes);
+
+/// release memory obtained from allocate_data()
+void free_data(void *p);
+
+/// give number of bytes of the given range backed by huge pages
+/**
+ * Huge pages are granted by the kernel when memory is first touched, so
+ * this should be queried after the data has been written. Always zero if
+ * the platform does not report it.
+ */
+std::size_t huge_page_bytes(const void *p, std::size_t bytes);
+
+#endif // inclusion guard
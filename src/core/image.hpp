@@ -21,6 +21,8 @@
 #include <cstdint>
 #include <memory>
 
+#include "storage.hpp"
+
 /// image data
 /**
  * The image's origin is lower left.
@@ -30,7 +32,7 @@ class image
 {
 
   std::size_t m_dims[3]; ///< image dimensions
-  std::unique_ptr<T []> m_data; ///< image data, row-wise storage
+  storage<T> m_data; ///< image data, row-wise storage
 
 public:
 
@@ -42,8 +44,20 @@ public:
 
   /// create image with given dimensions
   image(std::size_t channels, std::size_t width, std::size_t height)
-    : m_dims{channels, width, height}, m_data{new T[channels * width * height]}
+    : m_dims{channels, width, height}, m_data{channels * width * height}
+  {
+  }
+
+  /// create image with given dimensions on existing storage
+  image(std::size_t channels, std::size_t width, std::size_t height, storage<T> &&data)
+    : m_dims{channels, width, height}, m_data{std::move(data)}
+  {
+  }
+
+  /// create image sharing this image's data
+  image share() const
   {
+    return image(channels(), width(), height(), m_data.share());
   }
 
   /// give image number of channels
@@ -67,13 +81,13 @@ public:
   /// raw data access
   T *data()
   {
-    return m_data.get();
+    return m_data.data();
   }
 
   /// raw data access
   const T *data() const
   {
-    return m_data.get();
+    return m_data.data();
   }
 
   /// access pixel at position
@@ -82,7 +96,7 @@ public:
     assert(1 == channels());
     assert(x < width());
     assert(y < height());
-    return m_data[y*width()+x];
+    return m_data.data()[y*width()+x];
   }
 
   /// access pixel at position
@@ -91,7 +105,7 @@ public:
     assert(1 == channels());
     assert(x < width());
     assert(y < height());
-    return m_data[y*width()+x];
+    return m_data.data()[y*width()+x];
   }
 
   /// access pixel at position
@@ -100,7 +114,7 @@ public:
     assert(c < channels());
     assert(x < width());
     assert(y < height());
-    return m_data[(y*width()+x)*channels()+c];
+    return m_data.data()[(y*width()+x)*channels()+c];
   }
 
   /// access pixel at position
@@ -109,7 +123,7 @@ public:
     assert(c < channels());
     assert(x < width());
     assert(y < height());
-    return m_data[(y*width()+x)*channels()+c];
+    return m_data.data()[(y*width()+x)*channels()+c];
   }
 
 };
@@ -17,7 +17,11 @@
 #include "oct_data.hpp"
 
 #include <algorithm>
+#include <cstdio>
 #include <cstring>
+#include <stdexcept>
+
+#include "progressive.hpp"
 
 using namespace std;
 
@@ -27,7 +31,8 @@ namespace
   {
     string name;
     vector<string> extensions;
-    function<void (const char *, oct_subject &s)> read;
+    function<void (const char *, oct_subject &s, const oct_load_options &options)> read;
+    oct_probe probe;
   };
 
   map<oct_reader *, reader_data> &oct_readers()
@@ -37,39 +42,134 @@ namespace
   }
 }
 
-oct_subject::oct_subject(const char *path)
+slice_source::~slice_source()
 {
-  string msg;
+}
+
+deferred_image::deferred_image()
+{
+}
+
+deferred_image::deferred_image(function<image<uint8_t> ()> &&decode)
+  : m(make_shared<state>())
+{
+  m->decode = move(decode);
+}
+
+const image<uint8_t> &deferred_image::get() const
+{
+  if (!m)
+    throw runtime_error("no image");
+
+  call_once(m->once, [this]() {
+    m->img = m->decode();
+    m->decode = nullptr;
+  });
+  return m->img;
+}
+
+oct_subject::oct_subject(const char *path, const oct_load_options &options)
+{
+  // read start of file for content probes
+  vector<char> head(oct_probe_size);
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    throw runtime_error(string("could not open \"") + path + "\"");
+  head.resize(fread(head.data(), 1, head.size(), f));
+  fclose(f);
 
-  // try to open file with each reader handling the extension
-  auto &readers = oct_readers();
-  for (auto &p : readers)
+  // readers recognizing the contents, those handling the extension first,
+  // then readers without probe handling the extension
+  string msg;
+  vector<const reader_data *> matches, others;
+  for (auto &p : oct_readers())
   {
-    bool can_read = false;
+    bool extension = false;
     for (auto &s : p.second.extensions)
       if (strlen(path) >= s.length() && path + strlen(path) - s.length() == s)
-        can_read = true;
+        extension = true;
 
-    if (can_read)
+    if (p.second.probe)
     {
-      try
+      if (p.second.probe(head.data(), head.size()))
+        (extension ? matches : others).push_back(&p.second);
+      else if (extension)
+        msg += p.second.name + ": unrecognized contents\n";
+    }
+    else if (extension)
+      others.push_back(&p.second);
+  }
+  matches.insert(matches.end(), others.begin(), others.end());
+
+  if (matches.empty())
+    throw runtime_error(msg + "Unrecognized file format.");
+
+  for (const reader_data *r : matches)
+  {
+    try
+    {
+      r->read(path, *this, options);
+
+      // readers without scan selection load all scans, drop unwanted ones
+      if (!options.scans.empty())
       {
-        p.second.read(path, *this);
-        return;
+        for (auto i = scans.begin(); i != scans.end();)
+          if (options.scans.count(i->first))
+            ++i;
+          else
+            i = scans.erase(i);
       }
-      catch (exception &e)
+
+      for (auto &s : scans)
       {
-        msg += p.second.name + ": " + e.what() + "\n";
+        oct_scan &scan = s.second;
+        if (scan.dimensions[0] == 0 && scan.tomogram.data())
+        {
+          scan.dimensions[0] = scan.tomogram.width() << scan.reduced;
+          scan.dimensions[1] = scan.tomogram.height() << scan.reduced;
+          scan.dimensions[2] = scan.tomogram.depth();
+        }
+
+        // readers without metadata modes load everything, drop it
+        if (options.payload != oct_payload::all)
+        {
+          scan.fundus = image<uint8_t>();
+          scan.tomogram = volume<uint8_t>();
+          scan.slices.reset();
+          scan.images.clear();
+        }
+        if (options.payload == oct_payload::metadata)
+          scan.contours.clear();
+
+        // tomogram left to be decoded from its slices
+        if (options.progressive && options.cache_bytes == 0 && options.payload == oct_payload::all && !scan.tomogram.data() && scan.slices)
+        {
+          scan.tomogram = volume<uint8_t>(scan.slices->width(), scan.slices->height(), scan.slices->depth());
+          scan.progress = make_shared<progressive_tomogram>(scan.slices, scan.tomogram);
+        }
       }
+
+      return;
+    }
+    catch (exception &e)
+    {
+      msg += r->name + ": " + e.what() + "\n";
+      scans.clear();
+      info.clear();
     }
   }
 
   throw runtime_error(msg + "Could not read the file.");
 }
 
-oct_reader::oct_reader(std::string &&name, std::vector<std::string> &&extensions, std::function<void (const char *, oct_subject &s)> &&read)
+oct_reader::oct_reader(std::string &&name, std::vector<std::string> &&extensions, std::function<void (const char *, oct_subject &s)> &&read, oct_probe &&probe)
+  : oct_reader(move(name), move(extensions), [read](const char *path, oct_subject &s, const oct_load_options &) { read(path, s); }, move(probe))
+{
+}
+
+oct_reader::oct_reader(std::string &&name, std::vector<std::string> &&extensions, std::function<void (const char *, oct_subject &s, const oct_load_options &options)> &&read, oct_probe &&probe)
 {
-  oct_readers().insert(make_pair(this, reader_data{move(name), move(extensions), move(read)}));
+  oct_readers().insert(make_pair(this, reader_data{move(name), move(extensions), move(read), move(probe)}));
 }
 
 oct_reader::~oct_reader()
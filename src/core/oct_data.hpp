@@ -21,10 +21,13 @@
 #include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
 #include <vector>
 
 #include "image.hpp"
+#include "view.hpp"
 #include "volume.hpp"
 
 /// axis-parallel bounding box
@@ -36,6 +39,123 @@ struct bounding_box
   std::size_t maxy; ///< upper
 };
 
+/// parts of an OCT file to load
+enum class oct_payload
+{
+  all, ///< everything the reader supports
+  metadata, ///< info, sizes and tomogram dimensions, no images or contours
+  contours ///< metadata and contours, no images, e.g. for thickness statistics
+};
+
+/// options for loading OCT files
+struct oct_load_options
+{
+
+  /// decode images at 1/2^reduce of their resolution where the format allows it
+  /**
+   * Used for a quick first look at large files. Readers that cannot reduce
+   * the resolution load at full size. Readers that can decode parts of
+   * slices keep them compressed in oct_scan::slices.
+   */
+  unsigned reduce = 0;
+
+  /// parts to load
+  /**
+   * With oct_payload::metadata, readers skip image data and only fill in the
+   * info maps, size, range and dimensions, e.g. for indexing many files.
+   */
+  oct_payload payload = oct_payload::all;
+
+  /// keys of the scans to load, all scans if empty
+  /**
+   * Readers of multi-scan files skip the data of other scans, e.g. to open
+   * one series after listing them with oct_payload::metadata.
+   */
+  std::set<std::string> scans;
+
+  /// keep tomograms out of core with this many bytes of decoded slices
+  /**
+   * If not zero, readers that can decode single slices leave
+   * oct_scan::tomogram empty and provide oct_scan::slices through a
+   * slice_cache with this budget. Others load the tomogram as usual.
+   */
+  std::size_t cache_bytes = 0;
+
+  /// decode tomograms in the background, middle slice first
+  /**
+   * Readers that can decode single slices return once the compressed slices
+   * are located. The tomogram is then filled by oct_scan::progress while it
+   * is shown. Others load the tomogram as usual.
+   */
+  bool progressive = false;
+
+};
+
+/// tomogram slices decoded on demand
+/**
+ * Gives access to slices at full resolution while they are kept in their
+ * compressed form, e.g. to show details of a tomogram that was loaded at
+ * reduced resolution.
+ */
+class slice_source
+{
+public:
+
+  virtual ~slice_source();
+
+  /// full resolution width of slices
+  virtual std::size_t width() const = 0;
+
+  /// full resolution height of slices
+  virtual std::size_t height() const = 0;
+
+  /// number of slices
+  virtual std::size_t depth() const = 0;
+
+  /// decode part of slice z starting at (x, y) with the size of dst into dst
+  virtual void read(std::size_t z, std::size_t x, std::size_t y, const image_view<uint8_t> &dst) = 0;
+};
+
+/// image decoded on first access
+/**
+ * Readers use this for images that are rarely needed, so loading does not
+ * pay for decoding them. Copies share the decoded image. Safe to access
+ * from several threads.
+ */
+class deferred_image
+{
+  struct state
+  {
+    std::once_flag once;
+    std::function<image<uint8_t> ()> decode;
+    image<uint8_t> img;
+  };
+
+  std::shared_ptr<state> m;
+
+public:
+
+  /// no image
+  deferred_image();
+
+  /// image given by decode function
+  explicit deferred_image(std::function<image<uint8_t> ()> &&decode);
+
+  /// decode image if not done yet and give it
+  /**
+   * Throws if decoding fails, later accesses then try again.
+   */
+  const image<uint8_t> &get() const;
+
+  /// image present?
+  explicit operator bool() const
+  {
+    return bool(m);
+  }
+};
+
+class progressive_tomogram;
+
 /// one OCT C-scan
 struct oct_scan
 {
@@ -52,6 +172,12 @@ struct oct_scan
   /// reconstructed OCT C-scan
   volume<uint8_t> tomogram;
 
+  /// width, height and depth of the full resolution tomogram in voxels
+  /**
+   * Also given if the tomogram itself is not loaded.
+   */
+  std::size_t dimensions[3] = {0, 0, 0};
+
   /// list of contours
   std::map<std::string, image<float>> contours;
 
@@ -63,8 +189,37 @@ struct oct_scan
    */
   std::map<std::string, std::string> info;
 
+  /// resolution reduction of fundus and tomogram
+  /**
+   * Width and height of the images are 1/2^reduced of their full size,
+   * range and contours refer to the reduced images. Zero at full resolution.
+   */
+  unsigned reduced = 0;
+
+  /// full resolution slices, if the reader keeps them to decode on demand
+  /**
+   * The only slices if the tomogram is kept out of core, see
+   * oct_load_options::cache_bytes.
+   */
+  std::shared_ptr<slice_source> slices;
+
+  /// slices of the tomogram decoded so far, null if complete
+  /**
+   * See oct_load_options::progressive.
+   */
+  std::shared_ptr<progressive_tomogram> progress;
+
+  /// additional images by name, e.g. "color fundus", decoded when accessed
+  std::map<std::string, deferred_image> images;
+
 };
 
+/// tomogram height in the units of contours, also if it is not loaded
+inline std::size_t tomogram_height(const oct_scan &scan)
+{
+  return scan.tomogram.data() ? scan.tomogram.height() : scan.dimensions[1];
+}
+
 /// collection of OCT scans of a subject
 struct oct_subject
 {
@@ -81,15 +236,29 @@ struct oct_subject
    */
   std::map<std::string, std::string> info;
 
+  /// empty subject
+  oct_subject() = default;
+
   /// load oct file
-  oct_subject(const char *path);
+  oct_subject(const char *path, const oct_load_options &options = oct_load_options());
 
 };
 
+/// check of the first bytes of a file, true if a reader recognizes them
+typedef std::function<bool (const char *head, std::size_t size)> oct_probe;
+
+/// number of bytes at the start of a file given to oct_probe
+const std::size_t oct_probe_size = 16384;
+
 /// OCT data reader description
+/**
+ * Readers with a probe are chosen by file contents, others by extension.
+ * Readers matching the extension are tried first.
+ */
 struct oct_reader
 {
-  oct_reader(std::string &&name, std::vector<std::string> &&extensions, std::function<void (const char *, oct_subject &s)> &&read);
+  oct_reader(std::string &&name, std::vector<std::string> &&extensions, std::function<void (const char *, oct_subject &s)> &&read, oct_probe &&probe = oct_probe());
+  oct_reader(std::string &&name, std::vector<std::string> &&extensions, std::function<void (const char *, oct_subject &s, const oct_load_options &options)> &&read, oct_probe &&probe = oct_probe());
   oct_reader(oct_reader &&) = delete;
   oct_reader(const oct_reader &) = delete;
   oct_reader &operator=(oct_reader &&) = delete;
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2015 TU Chemnitz
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "parallel.hpp"
+
+using namespace std;
+
+size_t concurrency()
+{
+  static const size_t n = max(1u, thread::hardware_concurrency());
+  return n;
+}
+
+task_group::task_group(size_t threads)
+  : m_busy(0),
+    m_done(false)
+{
+  for (size_t i = 0; i != max<size_t>(threads, 1); ++i)
+    m_threads.emplace_back(&task_group::work, this);
+}
+
+task_group::~task_group()
+{
+  {
+    unique_lock<mutex> lock(m_mutex);
+    m_idle.wait(lock, [this]() { return m_tasks.empty() && m_busy == 0; });
+    m_done = true;
+  }
+  m_wake.notify_all();
+  for (thread &t: m_threads)
+    t.join();
+}
+
+void task_group::run(function<void()> task)
+{
+  {
+    lock_guard<mutex> lock(m_mutex);
+    m_tasks.push_back(move(task));
+  }
+  m_wake.notify_one();
+}
+
+void task_group::wait()
+{
+  unique_lock<mutex> lock(m_mutex);
+  m_idle.wait(lock, [this]() { return m_tasks.empty() && m_busy == 0; });
+  if (m_error)
+  {
+    exception_ptr e = m_error;
+    m_error = nullptr;
+    rethrow_exception(e);
+  }
+}
+
+void task_group::work()
+{
+  unique_lock<mutex> lock(m_mutex);
+  for (;;)
+  {
+    m_wake.wait(lock, [this]() { return m_done || !m_tasks.empty(); });
+    if (m_tasks.empty())
+      return;
+
+    function<void()> task = move(m_tasks.front());
+    m_tasks.pop_front();
+    ++m_busy;
+    lock.unlock();
+
+    try
+    {
+      task();
+    }
+    catch (...)
+    {
+      lock.lock();
+      if (!m_error)
+        m_error = current_exception();
+      lock.unlock();
+    }
+
+    lock.lock();
+    --m_busy;
+    if (m_tasks.empty() && m_busy == 0)
+      m_idle.notify_all();
+  }
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright 2015 TU Chemnitz
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// number of worker threads to use
+std::size_t concurrency();
+
+/// queue of tasks run by a set of worker threads
+/**
+ * Tasks may be added while earlier ones are running, e.g. from a loader that
+ * hands off decoding while it reads on. The first exception thrown by a task
+ * is rethrown by wait(). The destructor waits for all tasks.
+ */
+class task_group
+{
+  std::vector<std::thread> m_threads;
+  std::deque<std::function<void()>> m_tasks;
+  std::mutex m_mutex;
+  std::condition_variable m_wake; ///< signals new tasks or shutdown
+  std::condition_variable m_idle; ///< signals finished tasks
+  std::size_t m_busy; ///< tasks currently running
+  std::exception_ptr m_error;
+  bool m_done;
+
+  void work();
+
+public:
+
+  /// start given number of worker threads
+  explicit task_group(std::size_t threads = concurrency());
+
+  /// wait for all tasks and stop workers
+ ~task_group();
+
+  task_group(const task_group&) = delete;
+  task_group& operator=(const task_group&) = delete;
+
+  /// queue task
+  void run(std::function<void()> task);
+
+  /// wait for all queued tasks, rethrow first error
+  void wait();
+};
+
+/// call f(i) for all i in [begin, end) on all cores
+template <class F>
+void parallel_for(std::size_t begin, std::size_t end, F f)
+{
+  const std::size_t n = end - begin, threads = std::min(concurrency(), n);
+  if (threads <= 1)
+  {
+    for (std::size_t i = begin; i != end; ++i)
+      f(i);
+    return;
+  }
+
+  task_group g(threads);
+  for (std::size_t t = 0; t != threads; ++t)
+  {
+    const std::size_t b = begin + n * t / threads, e = begin + n * (t + 1) / threads;
+    g.run([b, e, &f]() {
+      for (std::size_t i = b; i != e; ++i)
+        f(i);
+    });
+  }
+  g.wait();
+}
+
+#endif // inclusion guard
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2015 TU Chemnitz
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "progressive.hpp"
+
+#include <algorithm>
+#include <exception>
+#include <qDebug>
+
+using namespace std;
+
+progressive_tomogram::progressive_tomogram(const shared_ptr<slice_source> &source, const volume<uint8_t> &tomogram)
+  : m_source(source),
+    m_tomogram(tomogram.share()),
+    m_ready(new atomic<bool>[tomogram.depth()]),
+    m_next(0),
+    m_count(0),
+    m_stop(false),
+    m_failed(false),
+    m_tasks(max<size_t>(1, min(concurrency(), tomogram.depth())))
+{
+  for (size_t z = 0; z != m_tomogram.depth(); ++z)
+    m_ready[z] = false;
+
+  for (size_t i = 0, n = max<size_t>(1, min(concurrency(), m_tomogram.depth())); i != n; ++i)
+    m_tasks.run([this]() { work(); });
+}
+
+progressive_tomogram::~progressive_tomogram()
+{
+  m_stop = true;
+  m_tasks.wait();
+}
+
+void progressive_tomogram::work()
+{
+  const size_t depth = m_tomogram.depth();
+  for (size_t i; !m_stop && (i = m_next++) < depth; )
+  {
+    const size_t z = order(i, depth);
+    try
+    {
+      m_source->read(z, 0, 0, view(m_tomogram).slice(z));
+    }
+    catch (exception &e)
+    {
+      qDebug() << "slice" << z << "failed to decode:" << e.what();
+      fill_n(m_tomogram.data() + z * m_tomogram.width() * m_tomogram.height(), m_tomogram.width() * m_tomogram.height(), uint8_t(0));
+      m_failed.store(true, memory_order_release);
+    }
+    m_ready[z].store(true, memory_order_release);
+    if (++m_count == depth)
+    {
+      lock_guard<mutex> lock(m_mutex);
+      m_finished.notify_all();
+    }
+  }
+}
+
+void progressive_tomogram::wait()
+{
+  unique_lock<mutex> lock(m_mutex);
+  m_finished.wait(lock, [this]() { return done(); });
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2015 TU Chemnitz
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef PROGRESSIVE_HPP
+#define PROGRESSIVE_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+
+#include "oct_data.hpp"
+#include "parallel.hpp"
+
+/// tomogram filled from a slice source in the background
+/**
+ * Reads the middle slice first and then fans outward, so the slice shown
+ * initially is there after decoding one slice. Each finished slice is
+ * published and may be read while the others are still being decoded.
+ * Slices that fail to decode are published black and flagged by failed(). The destructor skips the
+ * remaining slices and waits for the ones being decoded.
+ */
+class progressive_tomogram
+{
+  const std::shared_ptr<slice_source> m_source;
+  volume<uint8_t> m_tomogram; ///< shares the memory of the filled tomogram
+  std::unique_ptr<std::atomic<bool>[]> m_ready;
+  std::atomic<std::size_t> m_next; ///< next slice to start, in loading order
+  std::atomic<std::size_t> m_count; ///< finished slices
+  std::atomic<bool> m_stop;
+  std::atomic<bool> m_failed; ///< some slice failed to decode
+  std::mutex m_mutex;
+  std::condition_variable m_finished; ///< signals the last slice
+  task_group m_tasks;
+
+  void work();
+
+public:
+
+  /// start filling tomogram, which must have the dimensions of source
+  progressive_tomogram(const std::shared_ptr<slice_source> &source, const volume<uint8_t> &tomogram);
+
+  /// stop filling
+ ~progressive_tomogram();
+
+  progressive_tomogram(const progressive_tomogram&) = delete;
+  progressive_tomogram& operator=(const progressive_tomogram&) = delete;
+
+  /// slice z decoded?
+  bool ready(std::size_t z) const
+  {
+    return m_ready[z].load(std::memory_order_acquire);
+  }
+
+  /// number of decoded slices
+  std::size_t count() const
+  {
+    return m_count.load(std::memory_order_acquire);
+  }
+
+  /// all slices decoded?
+  bool done() const
+  {
+    return count() == m_tomogram.depth();
+  }
+
+  /// some slice failed to decode and was published black?
+  bool failed() const
+  {
+    return m_failed.load(std::memory_order_acquire);
+  }
+
+  /// wait for all slices, e.g. before saving the tomogram
+  void wait();
+
+  /// slice loaded i-th out of depth, middle first
+  static std::size_t order(std::size_t i, std::size_t depth)
+  {
+    // alternate below and above, for even depth one slice is left below
+    const std::size_t middle = depth / 2, above = depth - middle - 1;
+    if (i > 2 * above)
+      return middle - (i - above);
+    return i % 2 ? middle - (i + 1) / 2 : middle + i / 2;
+  }
+};
+
+#endif // inclusion guard
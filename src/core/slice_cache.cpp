@@ -0,0 +1,83 @@
+/*
+ * Copyright 2015 TU Chemnitz
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "slice_cache.hpp"
+
+#include <stdexcept>
+
+#include "view.hpp"
+
+using namespace std;
+
+slice_cache::slice_cache(const shared_ptr<slice_source> &source, size_t budget)
+  : m_source(source),
+    m_budget(budget),
+    m_bytes(0)
+{
+}
+
+size_t slice_cache::width() const
+{
+  return m_source->width();
+}
+
+size_t slice_cache::height() const
+{
+  return m_source->height();
+}
+
+size_t slice_cache::depth() const
+{
+  return m_source->depth();
+}
+
+void slice_cache::read(size_t z, size_t x, size_t y, const image_view<uint8_t> &dst)
+{
+  if (z >= depth() || x > width() || dst.width() > width() - x || y > height() || dst.height() > height() - y)
+    throw runtime_error("slice region out of range");
+
+  lock_guard<mutex> lock(m_mutex);
+  auto i = m_slices.find(z);
+  if (i != m_slices.end())
+    m_order.splice(m_order.begin(), m_order, i->second.order);
+  else
+  {
+    image<uint8_t> img(1, width(), height());
+    m_source->read(z, 0, 0, view(img));
+
+    // drop least recently used slices to make room
+    const size_t n = width() * height();
+    while (!m_order.empty() && m_bytes + n > m_budget)
+    {
+      m_slices.erase(m_order.back());
+      m_order.pop_back();
+      m_bytes -= n;
+    }
+
+    m_order.push_front(z);
+    i = m_slices.insert(make_pair(z, entry{move(img), m_order.begin()})).first;
+    m_bytes += n;
+  }
+
+  copy(image_view<const uint8_t>(view(i->second.img)).sub(x, y, dst.width(), dst.height()), dst);
+}
+
+size_t slice_cache::bytes() const
+{
+  lock_guard<mutex> lock(m_mutex);
+  return m_bytes;
+}
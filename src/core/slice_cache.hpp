@@ -0,0 +1,70 @@
+/*
+ * Copyright 2015 TU Chemnitz
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef SLICE_CACHE_HPP
+#define SLICE_CACHE_HPP
+
+#include <cstddef>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "image.hpp"
+#include "oct_data.hpp"
+
+/// decoded slices of a slice source within a memory budget
+/**
+ * Decodes whole slices on first access and keeps them until the decoded
+ * bytes exceed the budget, then drops the least recently used ones. The most
+ * recent slice is always kept. Lets tomograms that do not fit into memory be
+ * viewed slice by slice.
+ */
+class slice_cache
+  : public slice_source
+{
+  typedef std::list<std::size_t> order_t;
+
+  struct entry
+  {
+    image<uint8_t> img;
+    order_t::iterator order; ///< position in m_order
+  };
+
+  const std::shared_ptr<slice_source> m_source;
+  const std::size_t m_budget;
+  std::size_t m_bytes; ///< bytes of decoded slices
+  std::map<std::size_t, entry> m_slices;
+  order_t m_order; ///< slices from most to least recently used
+  mutable std::mutex m_mutex;
+
+public:
+
+  /// cache slices of source using at most budget bytes
+  slice_cache(const std::shared_ptr<slice_source> &source, std::size_t budget);
+
+  std::size_t width() const override;
+  std::size_t height() const override;
+  std::size_t depth() const override;
+
+  void read(std::size_t z, std::size_t x, std::size_t y, const image_view<uint8_t> &dst) override;
+
+  /// bytes of decoded slices currently kept
+  std::size_t bytes() const;
+};
+
+#endif // inclusion guard
@@ -0,0 +1,95 @@
+/*
+ * Copyright 2015 TU Chemnitz
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef STORAGE_HPP
+#define STORAGE_HPP
+
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+
+#include "allocator.hpp"
+
+/// memory backing an image or volume
+/**
+ * The memory is either owned (allocated for the container), borrowed (owned
+ * elsewhere and guaranteed by the caller to outlive the container) or shared
+ * with other holders by reference counting, e.g. pages of a mapped file that
+ * stay mapped as long as any image points into them.
+ */
+template <class T>
+class storage
+{
+
+  T *m_data; ///< first element
+  std::shared_ptr<const void> m_owner; ///< keeps m_data alive, null if borrowed
+
+public:
+
+  /// create empty storage
+  storage()
+    : m_data{}, m_owner{}
+  {
+  }
+
+  /// allocate owned storage for given number of elements
+  /**
+   * Elements are left uninitialized, see allocate_data() for alignment.
+   */
+  explicit storage(std::size_t n)
+    : m_data{static_cast<T *>(allocate_data(n * sizeof(T)))}, m_owner{m_data, free_data}
+  {
+    static_assert(std::is_trivial<T>::value, "image and volume elements must be trivial types");
+  }
+
+  /// share memory kept alive by owner
+  storage(T *data, std::shared_ptr<const void> owner)
+    : m_data{data}, m_owner{std::move(owner)}
+  {
+  }
+
+  storage(storage &&) = default;
+  storage &operator=(storage &&) = default;
+  storage(const storage &) = delete;
+  storage &operator=(const storage &) = delete;
+
+  /// borrow memory owned elsewhere
+  static storage borrow(T *data)
+  {
+    return storage(data, nullptr);
+  }
+
+  /// give another reference to the same memory
+  storage share() const
+  {
+    return storage(m_data, m_owner);
+  }
+
+  /// is memory owned elsewhere?
+  bool borrowed() const
+  {
+    return m_data && !m_owner;
+  }
+
+  /// raw data access
+  T *data() const
+  {
+    return m_data;
+  }
+
+};
+
+#endif // inclusion guard
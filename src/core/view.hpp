@@ -0,0 +1,290 @@
+/*
+ * Copyright 2015 TU Chemnitz
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef VIEW_HPP
+#define VIEW_HPP
+
+#include <cassert>
+#include <cstddef>
+#include <type_traits>
+
+#include "image.hpp"
+#include "volume.hpp"
+
+/// strided view of two-dimensional data
+/**
+ * Strides are given in elements and may be negative or zero, so flipped,
+ * transposed, cropped or single-channel views of an image need no copy.
+ */
+template <class T>
+class image_view
+{
+
+  T *m_data; ///< element at (0, 0)
+  std::size_t m_dims[2]; ///< view dimensions
+  std::ptrdiff_t m_strides[2]; ///< distance between neighbouring elements in x and y
+
+public:
+
+  /// create view of raw data
+  image_view(T *data, std::size_t width, std::size_t height, std::ptrdiff_t xstride, std::ptrdiff_t ystride)
+    : m_data{data}, m_dims{width, height}, m_strides{xstride, ystride}
+  {
+  }
+
+  /// create view of contiguous row-wise data
+  image_view(T *data, std::size_t width, std::size_t height)
+    : image_view(data, width, height, 1, width)
+  {
+  }
+
+  /// convert to view of constant data
+  template <class U, class = typename std::enable_if<std::is_same<const U, T>::value>::type>
+  image_view(const image_view<U> &v)
+    : image_view(v.data(), v.width(), v.height(), v.xstride(), v.ystride())
+  {
+  }
+
+  /// give element at origin
+  T *data() const
+  {
+    return m_data;
+  }
+
+  /// give view width
+  std::size_t width() const
+  {
+    return m_dims[0];
+  }
+
+  /// give view height
+  std::size_t height() const
+  {
+    return m_dims[1];
+  }
+
+  /// give distance between horizontally neighbouring elements
+  std::ptrdiff_t xstride() const
+  {
+    return m_strides[0];
+  }
+
+  /// give distance between vertically neighbouring elements
+  std::ptrdiff_t ystride() const
+  {
+    return m_strides[1];
+  }
+
+  /// access element at position
+  T &operator()(std::size_t x, std::size_t y) const
+  {
+    assert(x < width());
+    assert(y < height());
+    return m_data[std::ptrdiff_t(x)*m_strides[0] + std::ptrdiff_t(y)*m_strides[1]];
+  }
+
+  /// mirror left and right
+  image_view flip_x() const
+  {
+    return image_view(m_data + (std::ptrdiff_t(width()) - 1)*m_strides[0], width(), height(), -m_strides[0], m_strides[1]);
+  }
+
+  /// mirror top and bottom
+  image_view flip_y() const
+  {
+    return image_view(m_data + (std::ptrdiff_t(height()) - 1)*m_strides[1], width(), height(), m_strides[0], -m_strides[1]);
+  }
+
+  /// swap x and y
+  image_view transpose() const
+  {
+    return image_view(m_data, height(), width(), m_strides[1], m_strides[0]);
+  }
+
+  /// give rectangular part
+  image_view sub(std::size_t x, std::size_t y, std::size_t width, std::size_t height) const
+  {
+    assert(x + width <= this->width());
+    assert(y + height <= this->height());
+    return image_view(m_data + std::ptrdiff_t(x)*m_strides[0] + std::ptrdiff_t(y)*m_strides[1], width, height, m_strides[0], m_strides[1]);
+  }
+
+};
+
+/// strided view of three-dimensional data
+template <class T>
+class volume_view
+{
+
+  T *m_data; ///< element at (0, 0, 0)
+  std::size_t m_dims[3]; ///< view dimensions
+  std::ptrdiff_t m_strides[3]; ///< distance between neighbouring elements in x, y and z
+
+public:
+
+  /// create view of raw data
+  volume_view(T *data, std::size_t width, std::size_t height, std::size_t depth, std::ptrdiff_t xstride, std::ptrdiff_t ystride, std::ptrdiff_t zstride)
+    : m_data{data}, m_dims{width, height, depth}, m_strides{xstride, ystride, zstride}
+  {
+  }
+
+  /// convert to view of constant data
+  template <class U, class = typename std::enable_if<std::is_same<const U, T>::value>::type>
+  volume_view(const volume_view<U> &v)
+    : volume_view(v.data(), v.width(), v.height(), v.depth(), v.xstride(), v.ystride(), v.zstride())
+  {
+  }
+
+  /// give view width
+  std::size_t width() const
+  {
+    return m_dims[0];
+  }
+
+  /// give view height
+  std::size_t height() const
+  {
+    return m_dims[1];
+  }
+
+  /// give view depth
+  std::size_t depth() const
+  {
+    return m_dims[2];
+  }
+
+  /// give element at origin
+  T *data() const
+  {
+    return m_data;
+  }
+
+  /// give distance between neighbouring elements in x
+  std::ptrdiff_t xstride() const
+  {
+    return m_strides[0];
+  }
+
+  /// give distance between neighbouring elements in y
+  std::ptrdiff_t ystride() const
+  {
+    return m_strides[1];
+  }
+
+  /// give distance between neighbouring elements in z
+  std::ptrdiff_t zstride() const
+  {
+    return m_strides[2];
+  }
+
+  /// access voxel at position
+  T &operator()(std::size_t x, std::size_t y, std::size_t z) const
+  {
+    assert(x < width());
+    assert(y < height());
+    assert(z < depth());
+    return m_data[std::ptrdiff_t(x)*m_strides[0] + std::ptrdiff_t(y)*m_strides[1] + std::ptrdiff_t(z)*m_strides[2]];
+  }
+
+  /// mirror along x
+  volume_view flip_x() const
+  {
+    return volume_view(m_data + (std::ptrdiff_t(width()) - 1)*m_strides[0], width(), height(), depth(), -m_strides[0], m_strides[1], m_strides[2]);
+  }
+
+  /// mirror along y
+  volume_view flip_y() const
+  {
+    return volume_view(m_data + (std::ptrdiff_t(height()) - 1)*m_strides[1], width(), height(), depth(), m_strides[0], -m_strides[1], m_strides[2]);
+  }
+
+  /// mirror along z
+  volume_view flip_z() const
+  {
+    return volume_view(m_data + (std::ptrdiff_t(depth()) - 1)*m_strides[2], width(), height(), depth(), m_strides[0], m_strides[1], -m_strides[2]);
+  }
+
+  /// give box-shaped part
+  volume_view sub(std::size_t x, std::size_t y, std::size_t z, std::size_t width, std::size_t height, std::size_t depth) const
+  {
+    assert(x + width <= this->width());
+    assert(y + height <= this->height());
+    assert(z + depth <= this->depth());
+    return volume_view(m_data + std::ptrdiff_t(x)*m_strides[0] + std::ptrdiff_t(y)*m_strides[1] + std::ptrdiff_t(z)*m_strides[2], width, height, depth, m_strides[0], m_strides[1], m_strides[2]);
+  }
+
+  /// give B-scan at depth z
+  image_view<T> slice(std::size_t z) const
+  {
+    assert(z < depth());
+    return image_view<T>(m_data + std::ptrdiff_t(z)*m_strides[2], width(), height(), m_strides[0], m_strides[1]);
+  }
+
+};
+
+/// view whole image or one of its channels
+template <class T>
+image_view<T> view(image<T> &img, std::size_t c = 0)
+{
+  assert(c < img.channels() || img.channels() == 0);
+  return image_view<T>(img.data() + c, img.width(), img.height(), img.channels(), img.channels() * img.width());
+}
+
+/// view whole image or one of its channels
+template <class T>
+image_view<const T> view(const image<T> &img, std::size_t c = 0)
+{
+  assert(c < img.channels() || img.channels() == 0);
+  return image_view<const T>(img.data() + c, img.width(), img.height(), img.channels(), img.channels() * img.width());
+}
+
+/// view whole volume
+template <class T>
+volume_view<T> view(volume<T> &v)
+{
+  return volume_view<T>(v.data(), v.width(), v.height(), v.depth(), 1, v.width(), v.width() * v.height());
+}
+
+/// view whole volume
+template <class T>
+volume_view<const T> view(const volume<T> &v)
+{
+  return volume_view<const T>(v.data(), v.width(), v.height(), v.depth(), 1, v.width(), v.width() * v.height());
+}
+
+/// apply function to each element of source and store in destination
+template <class S, class T, class F>
+void transform(const image_view<S> &src, const image_view<T> &dst, F f)
+{
+  assert(src.width() == dst.width());
+  assert(src.height() == dst.height());
+  for (std::size_t y = 0; y != src.height(); ++y)
+  {
+    S *p = src.data() + std::ptrdiff_t(y)*src.ystride();
+    T *q = dst.data() + std::ptrdiff_t(y)*dst.ystride();
+    for (std::size_t x = 0; x != src.width(); ++x, p += src.xstride(), q += dst.xstride())
+      *q = f(*p);
+  }
+}
+
+/// copy elements of source to destination
+template <class S, class T>
+void copy(const image_view<S> &src, const image_view<T> &dst)
+{
+  transform(src, dst, [](S &v) { return v; });
+}
+
+#endif // inclusion guard
@@ -20,13 +20,15 @@
 #include <cassert>
 #include <memory>
 
+#include "storage.hpp"
+
 /// volume data
 template <class T>
 class volume
 {
 
   std::size_t m_dims[3]; ///< volume dimensions
-  std::unique_ptr<T []> m_data; ///< volume data, row-wise storage
+  storage<T> m_data; ///< volume data, row-wise storage
 
 public:
 
@@ -38,8 +40,20 @@ public:
 
   /// create volume with given dimensions
   volume(std::size_t width, std::size_t height, std::size_t depth)
-    : m_dims{width, height, depth}, m_data{new T[width * height * depth]}
+    : m_dims{width, height, depth}, m_data{width * height * depth}
+  {
+  }
+
+  /// create volume with given dimensions on existing storage
+  volume(std::size_t width, std::size_t height, std::size_t depth, storage<T> &&data)
+    : m_dims{width, height, depth}, m_data{std::move(data)}
+  {
+  }
+
+  /// create volume sharing this volume's data
+  volume share() const
   {
+    return volume(width(), height(), depth(), m_data.share());
   }
 
   /// give volume width
@@ -63,13 +77,13 @@ public:
   /// raw data access
   T *data()
   {
-    return m_data.get();
+    return m_data.data();
   }
 
   /// raw data access
   const T *data() const
   {
-    return m_data.get();
+    return m_data.data();
   }
 
   /// access voxel at position
@@ -78,7 +92,7 @@ public:
     assert(x < width());
     assert(y < height());
     assert(z < depth());
-    return m_data[(z*height()+y)*width()+x];
+    return m_data.data()[(z*height()+y)*width()+x];
   }
 
   /// access voxel at position
@@ -87,7 +101,7 @@ public:
     assert(x < width());
     assert(y < height());
     assert(z < depth());
-    return m_data[(z*height()+y)*width()+x];
+    return m_data.data()[(z*height()+y)*width()+x];
   }
 
 };
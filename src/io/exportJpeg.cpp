@@ -2,36 +2,101 @@
 
 using namespace std;
 
+bool exportSliceAsJpeg(const string &filename, const image_view<const uint8_t> &slice, const uint8_t (&lut)[256], const vector<image_view<const float>> &contours, QColor contourColor)
+{
+    const size_t width = slice.width(), height = slice.height();
+
+    //convert grayscale to RGBA
+    unique_ptr<uint8_t []> d_asRgba(new uint8_t[width*height*4]);
+    for (size_t y = 0; y != height; ++y)
+    {
+        for (size_t x = 0; x != width; ++x)
+        {
+            uint8_t *p = &d_asRgba[(y * width + x) * 4];
+            p[0] = p[1] = p[2] = lut[slice(x, y)];
+            p[3] = 255; //no transparency
+        }
+    }
+
+    //draw contours to image
+    const uint8_t color[4] = {uint8_t(contourColor.red()), uint8_t(contourColor.green()), uint8_t(contourColor.blue()), uint8_t(contourColor.alpha())};
+    for (const image_view<const float> &c : contours)
+    {
+        for (size_t x = 0; x != min(width, c.width()); ++x)
+        {
+            float contourValue = c(x, 0);
+            if (contourValue != contourValue)
+                continue;
+            int y = (int)(contourValue + 0.5f); //round value to full pixels
+
+            //make line thickness 3 pixel
+            for (int k = max(y - 1, 0); k <= min(y + 1, int(height) - 1); ++k)
+                copy_n(color, 4, &d_asRgba[(k * width + x) * 4]);
+        }
+    }
+
+    //export to file
+    return jpge::compress_image_to_jpeg_file(filename.c_str(), width, height, 4, d_asRgba.get());
+}
+
 bool exportSlicesAsJpeg(const oct_scan* scan, string filename_base, std::vector<int> contourList, QColor contourColor)
 {
-    // shorthand
-    size_t size = scan->tomogram.width() * scan->tomogram.height() * scan->tomogram.depth();
+    const volume_view<const uint8_t> tomogram = view(scan->tomogram);
+
+    // tomograms kept out of core are read slice by slice
+    const shared_ptr<slice_source> &slices = scan->slices;
+    const bool out_of_core = !scan->tomogram.data() && slices;
+    const size_t depth = out_of_core ? slices->depth() : tomogram.depth();
+    image<uint8_t> buffer;
+    if (out_of_core)
+        buffer = image<uint8_t>(1, slices->width(), slices->height());
+
+    auto slice = [&](size_t z) -> image_view<const uint8_t> {
+        if (!out_of_core)
+            return tomogram.slice(z);
+
+        slices->read(z, 0, 0, view(buffer));
+        return view(buffer);
+    };
 
     // find min and max intensity value, discard upper and lower 1% as outliers
-    unique_ptr<uint8_t []> d(new uint8_t[size]);
-    unique_ptr<uint8_t []> d_asRgba(new uint8_t[size*4]);
-    copy_n(scan->tomogram.data(), size, d.get());
-    uint8_t *p01 = d.get() + size / 100;
-    uint8_t *p99 = d.get() + size - (size + 99) / 100;
-    nth_element(d.get(), p01, d.get() + size);
-    nth_element(d.get(), p99, d.get() + size);
-    uint8_t minv = *p01, maxv = *p99;
-
-    for (size_t k = 0; k != size; ++k) {
-        // turn image negative and maximize contrast
-        d[k] = uint8_t(numeric_limits<uint8_t>::max() * min(1.0, max(0.0, (1.0 - double(scan->tomogram.data()[k] - minv) / (maxv - minv)))));
-
-        //convert grayscale to RGBA
-        d_asRgba[4*k+0] = d[k];
-        d_asRgba[4*k+1] = d[k];
-        d_asRgba[4*k+2] = d[k];
-        d_asRgba[4*k+3] = 255; //no transparency
+    size_t size = 0;
+    size_t histogram[256] = {};
+    if (out_of_core)
+    {
+        for (size_t z = 0; z != depth; ++z)
+        {
+            const image_view<const uint8_t> s = slice(z);
+            for (size_t y = 0; y != s.height(); ++y)
+                for (size_t x = 0; x != s.width(); ++x)
+                    ++histogram[s(x, y)];
+            size += s.width() * s.height();
+        }
+    }
+    else
+    {
+        size = tomogram.width() * tomogram.height() * tomogram.depth();
+        for (size_t k = 0; k != size; ++k)
+            ++histogram[scan->tomogram.data()[k]];
     }
 
+    auto percentile = [&](size_t n) {
+        size_t v = 0;
+        for (size_t sum = histogram[0]; sum <= n && v != 255; sum += histogram[++v]);
+        return uint8_t(v);
+    };
+    uint8_t minv = percentile(size / 100), maxv = percentile(size - (size + 99) / 100);
+
+    // turn image negative and maximize contrast
+    uint8_t lut[256];
+    for (size_t k = 0; k != 256; ++k)
+        lut[k] = uint8_t(numeric_limits<uint8_t>::max() * min(1.0, max(0.0, (1.0 - double(uint8_t(k) - minv) / (maxv - minv)))));
+
     //export every layer of the 3d volume as 2d image
-    for (size_t z = 0; z != scan->tomogram.depth(); ++z)
+    bool ok = true;
+    for (size_t z = 0; z != depth; ++z)
     {
-        //draw contours to image
+        vector<image_view<const float>> contours;
         for (int contourID : contourList)
         {
             auto it = scan->contours.begin();
@@ -44,37 +109,13 @@ bool exportSlicesAsJpeg(const oct_scan* scan, string filename_base, std::vector<
             if (test != test)
                 continue;
 
-            for (size_t x = 0; x != scan->tomogram.width(); ++x)
-            {
-                float contourValue = c(x,z);
-                if (contourValue != contourValue)
-                    continue;
-                int y = (int)(contourValue + 0.5f); //round value to full pixels
-
-                int pos = ((z*scan->tomogram.height() + y )* scan->tomogram.width() + x)*4;
-                int posAbove = pos - 4*scan->tomogram.width();
-                int posBelow = pos + 4*scan->tomogram.width();
-
-                d_asRgba[pos+0] = contourColor.red();
-                d_asRgba[pos+1] = contourColor.green();
-                d_asRgba[pos+2] = contourColor.blue();
-                d_asRgba[pos+3] = contourColor.alpha();
-
-                //make line thickness 3 pixel
-                d_asRgba[posAbove+0] = contourColor.red();
-                d_asRgba[posAbove+1] = contourColor.green();
-                d_asRgba[posAbove+2] = contourColor.blue();
-                d_asRgba[posAbove+3] = contourColor.alpha();
-                d_asRgba[posBelow+0] = contourColor.red();
-                d_asRgba[posBelow+1] = contourColor.green();
-                d_asRgba[posBelow+2] = contourColor.blue();
-                d_asRgba[posBelow+3] = contourColor.alpha();
-            }
+            contours.push_back(view(c).sub(0, z, c.width(), 1));
         }
 
-        //export to file
         stringstream filename;
         filename << filename_base << "slice" << z << ".jpg";
-        jpge::compress_image_to_jpeg_file(filename.str().c_str(), scan->tomogram.width(), scan->tomogram.height(), 4, &d_asRgba[z*scan->tomogram.height()*scan->tomogram.width()*4]);
+        ok = exportSliceAsJpeg(filename.str(), slice(z), lut, contours, contourColor) && ok;
     }
+
+    return ok;
 }
@@ -2,14 +2,19 @@
 #define EXPORT_JPEG_HPP
 
 #include <algorithm>
+#include <limits>
 #include <memory>
 #include <sstream>
+#include <string>
+#include <vector>
 
 #include <QColor>
 
 #include "../core/oct_data.hpp"
+#include "../core/view.hpp"
 #include "jpge.h"
 
-bool exportSlicesAsJpeg(const oct_scan* scan, std::__cxx11::string filename_base, std::vector<int> contourList, QColor contourColor);
+bool exportSliceAsJpeg(const std::string &filename, const image_view<const uint8_t> &slice, const uint8_t (&lut)[256], const std::vector<image_view<const float>> &contours, QColor contourColor);
+bool exportSlicesAsJpeg(const oct_scan* scan, std::string filename_base, std::vector<int> contourList, QColor contourColor);
 
 #endif //EXPORT_JPEG_HPP
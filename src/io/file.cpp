@@ -15,3 +15,191 @@
  */
 
 #include "file.hpp"
+
+#include <cerrno>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+bool file::map(const char *path)
+{
+#ifdef _WIN32
+  HANDLE f = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (f == INVALID_HANDLE_VALUE)
+    return false;
+
+  LARGE_INTEGER size;
+  HANDLE h = NULL;
+  if (GetFileSizeEx(f, &size) && size.QuadPart != 0 && size.QuadPart <= LONGLONG(SIZE_MAX))
+    h = CreateFileMappingA(f, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+  CloseHandle(f);
+  if (!h)
+    return false;
+
+  m_map = static_cast<const char *>(MapViewOfFile(h, FILE_MAP_COPY, 0, 0, 0));
+  CloseHandle(h);
+  if (!m_map)
+    return false;
+
+  m_size = size.QuadPart;
+  return true;
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  struct stat st;
+  void *p = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size != 0 && uint64_t(st.st_size) <= SIZE_MAX)
+    p = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return false;
+
+  m_map = static_cast<const char *>(p);
+  m_size = st.st_size;
+  return true;
+#endif
+}
+
+void file::unmap()
+{
+#ifdef _WIN32
+  UnmapViewOfFile(m_map);
+#else
+  munmap(const_cast<char *>(m_map), m_size);
+#endif
+}
+
+void file::open_handle(const char *path)
+{
+#ifdef _WIN32
+  // an independent file object with its own pointer, the one of the stdio
+  // handle is left alone
+  HANDLE h = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  m_handle = h != INVALID_HANDLE_VALUE ? h : 0;
+#else
+  (void)path;
+#endif
+}
+
+void file::close_handle()
+{
+#ifdef _WIN32
+  if (m_handle)
+    CloseHandle(m_handle);
+#endif
+}
+
+const char *file::find(const char *haystack, size_t size, const char *needle, size_t n)
+{
+#if defined(_WIN32) || !defined(_GNU_SOURCE)
+  const char *p = std::search(haystack, haystack + size, needle, needle + n);
+  return p != haystack + size ? p : 0;
+#else
+  return static_cast<const char *>(memmem(haystack, size, needle, n));
+#endif
+}
+
+uint64_t file::pos() const
+{
+  if (m_map)
+    return m_pos;
+
+#ifdef _WIN32
+  return _ftelli64(m);
+#else
+  return ftello(m);
+#endif
+}
+
+bool file::set(uint64_t pos)
+{
+  if (m_map)
+  {
+    m_pos = pos;
+    m_eof = false;
+    return true;
+  }
+
+#ifdef _WIN32
+  return _fseeki64(m, pos, SEEK_SET) == 0;
+#else
+  return fseeko(m, pos, SEEK_SET) == 0;
+#endif
+}
+
+size_t file::read_at(uint64_t offset, void *buf, size_t n) const
+{
+  if (m_map)
+  {
+    if (offset >= m_size)
+      return 0;
+
+    n = std::min<uint64_t>(n, m_size - offset);
+    std::memcpy(buf, m_map + offset, n);
+    return n;
+  }
+
+  size_t r = 0;
+#ifdef _WIN32
+  if (!m_handle)
+    throw std::runtime_error("positional reads not available for this file");
+
+  HANDLE h = m_handle;
+  while (r != n)
+  {
+    OVERLAPPED o = {};
+    o.Offset = DWORD(offset + r);
+    o.OffsetHigh = DWORD((offset + r) >> 32);
+    DWORD k;
+    if (!ReadFile(h, static_cast<char *>(buf) + r, DWORD(std::min<size_t>(n - r, 1 << 30)), &k, &o) || k == 0)
+      break;
+    r += k;
+  }
+#else
+  const int fd = fileno(m);
+  while (r != n)
+  {
+    ssize_t k = pread(fd, static_cast<char *>(buf) + r, n - r, offset + r);
+    if (k < 0 && errno == EINTR)
+      continue;
+    if (k <= 0)
+      break;
+    r += k;
+  }
+#endif
+  return r;
+}
+
+void file::advise(uint64_t offset, uint64_t n) const
+{
+#ifndef _WIN32
+  if (m_map)
+  {
+    if (offset >= m_size)
+      return;
+
+    // madvise needs a page aligned start
+    const uint64_t page = sysconf(_SC_PAGESIZE);
+    const uint64_t begin = offset / page * page;
+    n = std::min<uint64_t>(n, m_size - offset) + (offset - begin);
+    madvise(const_cast<char *>(m_map) + begin, n, MADV_WILLNEED);
+    return;
+  }
+
+#ifdef POSIX_FADV_WILLNEED
+  posix_fadvise(fileno(m), offset, n, POSIX_FADV_WILLNEED);
+#endif
+#else
+  (void)offset;
+  (void)n;
+#endif
+}
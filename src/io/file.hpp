@@ -17,91 +17,289 @@
 #ifndef FILE_HPP
 #define FILE_HPP
 
+#include <algorithm>
+#include <cstdint>
 #include <cstdio>
 #include <stdexcept>
 #include <cstring>
+#include <memory>
+#include <string>
 
 #include <qDebug>
 
+#include "../core/storage.hpp"
+
 /// convenient read access to a file
+/**
+ * An "m" in the open mode (e.g. "rbm") maps the whole file into memory. Reads are then plain copies from the mapped pages and data()
+ * exposes the file contents as one byte span. If the file cannot be mapped,
+ * it is read through stdio as usual.
+ *
+ * Mappings are private and copy-on-write, so images pointing into them (see
+ * mapped_storage()) may be modified without touching the file.
+ *
+ * Offsets are 64 bits wide. Besides the shared read position used by
+ * fetch() and read(), read_at() and file_cursor read at explicit offsets and
+ * may be used concurrently from several threads.
+ */
 class file
 {
   FILE *m;
-  size_t charsIgnored;
+  const char *m_map; ///< mapped file contents, null if not mapped
+  size_t m_size; ///< size of mapping
+  size_t m_pos; ///< read position in mapping
+  bool m_eof; ///< read past end of mapping
+  void *m_handle; ///< separate handle for read_at() on Windows, null elsewhere
+
+  bool map(const char *path);
+  void unmap();
+  void open_handle(const char *path);
+  void close_handle();
 
 public:
 
   /// open file
   file(const char *path, const char *mode)
-    : m(fopen(path, mode)),
-      charsIgnored(0)
+    : m(0),
+      m_map(0),
+      m_size(0),
+      m_pos(0),
+      m_eof(false),
+      m_handle(0)
   {
+    std::string fmode(mode);
+    fmode.erase(std::remove(fmode.begin(), fmode.end(), 'm'), fmode.end());
+    if (fmode.size() != std::strlen(mode) && fmode.find_first_of("wa+") == std::string::npos && map(path))
+      return;
+
+    m = fopen(path, fmode.c_str());
     if (!m)
       throw std::runtime_error(std::string("could not open \"") + path + "\"");
+    open_handle(path);
   }
 
   /// close file
  ~file()
   {
-    fclose(m);
+    if (m_map)
+      unmap();
+    else
+    {
+      close_handle();
+      fclose(m);
+    }
   }
 
   file(const file&) = delete;
   file& operator=(const file&) = delete;
-  
+
   /// find given string in file
-  void ignoreUntil(const char* t)
+  /**
+   * Positions the file at the first occurrence of the string at or after the
+   * current position and gives its offset. If there is none, the file is left
+   * at its end and the end offset is given.
+   */
+  uint64_t ignoreUntil(const char* t)
   {
-      if (t == "")
-          return;
+      if (*t == 0)
+          return pos();
+
+      if (m_map)
+      {
+          const size_t n = std::strlen(t);
+          const char *p = find(m_map + std::min(m_pos, m_size), m_size - std::min(m_pos, m_size), t, n);
+          m_pos = p ? p - m_map : m_size;
+          m_eof = !p;
+          return m_pos;
+      }
 
       int c; //current character got from file
-      int i = 0; //position in t
+      size_t i = 0; //position in t
       do {
           c = fgetc(m);
           //if a letter equals, try next, else word was not found
-          i = (c == t[i]) ? ++i : 0;
-          //qDebug() << QString("compare %1 with %2, --> i = %3 - at pos %4").arg(c).arg(t[i-1]).arg(i).arg(ftell(m));
+          i = (c == (unsigned char)t[i]) ? i + 1 : 0;
           if (i == std::strlen(t)) { //found
-              fseek(m, ftell(m)-strlen(t), SEEK_SET);
-              charsIgnored = ftell(m);
-              return;
+              set(pos() - i);
+              return pos();
           }
       } while(c != EOF);
+
+      return pos();
   }
 
   /// fetch binary value from file
   template <class T>
   bool fetch(T &t)
   {
-    return fread(&t, sizeof(T), 1, m) == 1;
+    return read(&t, 1) == 1;
   }
 
   /// read multiple bytes into buffer
   template <class T>
   size_t read(T *t, size_t n)
   {
-    return fread(t, sizeof(T), n, m);
+    if (!m_map)
+      return fread(t, sizeof(T), n, m);
+
+    size_t r = std::min(n, (m_size - std::min(m_pos, m_size)) / sizeof(T));
+    std::memcpy(t, m_map + m_pos, r * sizeof(T));
+    m_pos += r * sizeof(T);
+    if (r != n)
+    {
+      m_pos = std::max(m_pos, m_size);
+      m_eof = true;
+    }
+    return r;
   }
 
   /// current file position
-  size_t pos() const
+  uint64_t pos() const;
+
+  /// set file position
+  bool set(uint64_t pos);
+
+  /// read bytes at given offset without moving the file position
+  /**
+   * Uses pread() or the mapping and gives the number of bytes read, which is
+   * less than n only at the end of the file. Safe to call concurrently. On
+   * Windows, positional reads move the file pointer of their handle, so they
+   * go through a second handle of the file.
+   */
+  size_t read_at(uint64_t offset, void *buf, size_t n) const;
+
+  /// fetch binary value at given offset without moving the file position
+  template <class T>
+  bool fetch_at(uint64_t offset, T &t) const
   {
-    return ftell(m);
+    return read_at(offset, &t, sizeof(T)) == sizeof(T);
   }
 
-  /// set file position
-  bool set(size_t pos)
+  /// hint that the given range will be read soon
+  /**
+   * Starts readahead with posix_fadvise() or madvise(), does nothing where
+   * neither is available.
+   */
+  void advise(uint64_t offset, uint64_t n) const;
+
+  /// file contents if mapped, null otherwise
+  const char *data() const
+  {
+    return m_map;
+  }
+
+  /// size of mapped file contents
+  size_t size() const
   {
-    return fseek(m, pos + charsIgnored, SEEK_SET) == 0;
+    return m_size;
   }
 
   /// file ok?
   operator const void*() const
   {
+    if (m_map)
+      return !m_eof ? this : 0;
+
     return !feof(m) && !ferror(m) ? this : 0;
   }
 
+  /// find byte sequence in memory
+  static const char *find(const char *haystack, size_t size, const char *needle, size_t n);
+
 };
 
+/// independent read position in a file
+/**
+ * Reads through file::read_at(), so several cursors on one file may be used
+ * from different threads.
+ */
+class file_cursor
+{
+  const file &m_file;
+  uint64_t m_pos;
+  bool m_ok;
+  const char *m_buf; ///< prefetched file contents, may be null
+  uint64_t m_buf_pos; ///< file offset of prefetched contents
+  size_t m_buf_size; ///< size of prefetched contents
+
+public:
+
+  /// start reading at given offset
+  file_cursor(const file &f, uint64_t pos = 0)
+    : m_file(f), m_pos(pos), m_ok(true), m_buf(0), m_buf_pos(0), m_buf_size(0)
+  {
+  }
+
+  /// serve reads from prefetched contents where they cover the range
+  /**
+   * The buffer must hold the file contents starting at given offset and stay
+   * alive while the cursor is used. Reads outside of it go to the file.
+   */
+  void buffer(const char *data, uint64_t pos, size_t size)
+  {
+    m_buf = data;
+    m_buf_pos = pos;
+    m_buf_size = size;
+  }
+
+  /// fetch binary value
+  template <class T>
+  bool fetch(T &t)
+  {
+    return read(&t, 1) == 1;
+  }
+
+  /// read multiple values into buffer
+  template <class T>
+  size_t read(T *t, size_t n)
+  {
+    size_t r;
+    if (m_buf && m_pos >= m_buf_pos && m_pos - m_buf_pos <= m_buf_size && n * sizeof(T) <= m_buf_size - (m_pos - m_buf_pos))
+    {
+      r = n * sizeof(T);
+      std::memcpy(t, m_buf + (m_pos - m_buf_pos), r);
+    }
+    else
+      r = m_file.read_at(m_pos, t, n * sizeof(T));
+    m_pos += r;
+    m_ok = m_ok && r == n * sizeof(T);
+    return r / sizeof(T);
+  }
+
+  /// current position
+  uint64_t pos() const
+  {
+    return m_pos;
+  }
+
+  /// set position
+  void set(uint64_t pos)
+  {
+    m_pos = pos;
+    m_ok = true;
+  }
+
+  /// all reads complete?
+  operator const void*() const
+  {
+    return m_ok ? this : 0;
+  }
+
+};
+
+/// storage pointing into a mapped file
+/**
+ * Keeps the file mapped as long as the storage is alive. Gives empty storage
+ * if the file is not mapped, the range exceeds the file or the offset is not
+ * suitably aligned for T, in which case the caller has to read the data.
+ */
+template <class T>
+storage<T> mapped_storage(const std::shared_ptr<file> &f, size_t offset, size_t n)
+{
+  if (!f->data() || offset > f->size() || n > (f->size() - offset) / sizeof(T) || (uintptr_t(f->data()) + offset) % alignof(T) != 0)
+    return storage<T>();
+
+  return storage<T>(reinterpret_cast<T *>(const_cast<char *>(f->data() + offset)), f);
+}
+
 #endif // inclusion guard
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2015 TU Chemnitz
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "j2k.hpp"
+
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+void j2k_decoder::decode(const char *buf, size_t bufsize, const image_view<uint8_t> &dst, size_t channels, const j2k_region *region)
+{
+  decode(buf, bufsize, [&](size_t c, size_t width, size_t height) {
+    if (c != channels || width != dst.width() || height != dst.height())
+      throw runtime_error("size mismatch in jpeg2000 image");
+
+    return dst;
+  }, region);
+}
+
+namespace
+{
+  image<uint8_t> decode_image(const char *buf, size_t bufsize, const j2k_region *region, size_t threads, unsigned reduce)
+  {
+    image<uint8_t> img;
+    j2k_decoder(threads, reduce).decode(buf, bufsize, [&](size_t channels, size_t width, size_t height) {
+      img = image<uint8_t>(channels, width, height);
+      return view(img);
+    }, region);
+    return img;
+  }
+}
+
+image<uint8_t> decode_j2k(const char *buf, size_t bufsize, size_t threads, unsigned reduce)
+{
+  return decode_image(buf, bufsize, 0, threads, reduce);
+}
+
+image<uint8_t> decode_j2k(const char *buf, size_t bufsize, const j2k_region &region, size_t threads, unsigned reduce)
+{
+  return decode_image(buf, bufsize, &region, threads, reduce);
+}
+
+j2k_region j2k_clip_region(const j2k_region *region, size_t width, size_t height)
+{
+  if (!region)
+    return j2k_region{0, 0, width, height};
+
+  if (region->x > width || region->width > width - region->x || region->y > height || region->height > height - region->y)
+    throw runtime_error("region exceeds jpeg2000 image");
+
+  return *region;
+}
+
+void narrow_j2k_component(const int32_t *src, size_t width, size_t height, ptrdiff_t src_stride, const image_view<uint8_t> &dst, size_t c)
+{
+  if (width == 0)
+    return;
+
+  for (size_t y = 0; y != height; ++y, src += src_stride)
+  {
+    uint8_t *q = &dst(0, y) + c;
+    size_t x = 0;
+#ifdef __SSE2__
+    if (dst.xstride() == 1)
+    {
+      // mask to the lowest byte like the integer conversion, then pack
+      const __m128i mask = _mm_set1_epi32(0xff);
+      for (; x + 16 <= width; x += 16)
+      {
+        const __m128i *p = reinterpret_cast<const __m128i *>(src + x);
+        __m128i a = _mm_packs_epi32(_mm_and_si128(_mm_loadu_si128(p), mask), _mm_and_si128(_mm_loadu_si128(p + 1), mask));
+        __m128i b = _mm_packs_epi32(_mm_and_si128(_mm_loadu_si128(p + 2), mask), _mm_and_si128(_mm_loadu_si128(p + 3), mask));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(q + x), _mm_packus_epi16(a, b));
+      }
+    }
+#endif
+    for (; x != width; ++x)
+      q[ptrdiff_t(x) * dst.xstride()] = uint8_t(src[x]);
+  }
+}
@@ -14,12 +14,91 @@
  * limitations under the License.
  */
 
+
 #ifndef J2K_HPP
 #define J2K_HPP
 
+#include <cstdint>
+#include <functional>
+#include <memory>
+
 #include "../core/image.hpp"
+#include "../core/view.hpp"
+
+/// rectangular part of an image in pixels
+struct j2k_region
+{
+  std::size_t x, y, width, height;
+};
+
+/// reusable JPEG2000 decoder
+/**
+ * Decodes into caller memory, so images can be written straight into their
+ * place in a volume. State that can be kept between images is reused. One
+ * decoder must not be used from several threads at once, but several
+ * decoders may run concurrently.
+ */
+class j2k_decoder
+{
+  struct impl;
+  std::unique_ptr<impl> m;
+
+public:
+
+  /// destination for image with given number of channels and size
+  typedef std::function<image_view<uint8_t>(std::size_t channels, std::size_t width, std::size_t height)> target_fn;
+
+  /// create decoder
+  /**
+   * Backends that can decode one codestream on several threads use up to
+   * the given number of them. Images are decoded at 1/2^reduce of their
+   * resolution, i.e. with width and height divided and rounded up.
+   */
+  explicit j2k_decoder(std::size_t threads = 1, unsigned reduce = 0);
+
+ ~j2k_decoder();
+
+  j2k_decoder(const j2k_decoder&) = delete;
+  j2k_decoder& operator=(const j2k_decoder&) = delete;
+
+  /// decode image into memory given by target after reading the header
+  /**
+   * Channel c of pixel (x, y) is written to &dst(x, y) + c of the view
+   * returned by target. If a region of the (reduced) image is given, only
+   * that part is decoded and passed to target. openjpeg 2 decodes just the
+   * code blocks covering it, the other backends crop the full image.
+   */
+  void decode(const char *buf, std::size_t bufsize, const target_fn &target, const j2k_region *region = 0);
+
+  /// decode image or region of known size into view
+  void decode(const char *buf, std::size_t bufsize, const image_view<uint8_t> &dst, std::size_t channels = 1, const j2k_region *region = 0);
+};
 
 /// decode JPEG2000 image
-image<uint8_t> decode_j2k(char *buf, std::size_t bufsize);
+/**
+ * Safe to call from several threads at once.
+ */
+image<uint8_t> decode_j2k(const char *buf, std::size_t bufsize, std::size_t threads = 1, unsigned reduce = 0);
+
+/// decode region of JPEG2000 image
+image<uint8_t> decode_j2k(const char *buf, std::size_t bufsize, const j2k_region &region, std::size_t threads = 1, unsigned reduce = 0);
+
+/// size of image side at given resolution reduction
+inline std::size_t j2k_reduced_size(std::size_t n, unsigned reduce)
+{
+  return (n + (std::size_t(1) << reduce) - 1) >> reduce;
+}
+
+/// give region or whole image if none, throws if it exceeds the image
+/**
+ * Used by the backends.
+ */
+j2k_region j2k_clip_region(const j2k_region *region, std::size_t width, std::size_t height);
+
+/// copy decoded component samples, keeping the lowest 8 bits
+/**
+ * Used by the backends. Channel c of dst is at offset c from the view.
+ */
+void narrow_j2k_component(const int32_t *src, std::size_t width, std::size_t height, std::ptrdiff_t src_stride, const image_view<uint8_t> &dst, std::size_t c);
 
 #endif // inclusion guard
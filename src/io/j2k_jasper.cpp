@@ -16,6 +16,9 @@
 
 #include "j2k.hpp"
 
+#include <algorithm>
+#include <mutex>
+#include <new>
 #include <stdexcept>
 
 #include <jasper/jasper.h>
@@ -28,8 +31,8 @@ namespace
   struct j2k_stream
   {
     jas_stream_t *m;
-    j2k_stream(char *buf, size_t size)
-      : m(jas_stream_memopen(buf, size))
+    j2k_stream(const char *buf, size_t size)
+      : m(jas_stream_memopen(const_cast<char *>(buf), size))
     {
       if (!m)
         throw runtime_error("failed to create jpeg2000 stream");
@@ -44,6 +47,37 @@ namespace
     j2k_stream &operator=(const j2k_stream &) = delete;
   };
 
+  struct j2k_matrix
+  {
+    jas_matrix_t *m;
+    j2k_matrix()
+      : m(0)
+    {
+    }
+
+   ~j2k_matrix()
+    {
+      if (m)
+        jas_matrix_destroy(m);
+    }
+
+    j2k_matrix(const j2k_matrix &) = delete;
+    j2k_matrix &operator=(const j2k_matrix &) = delete;
+
+    /// make room for one row of given width
+    void resize(size_t width)
+    {
+      if (m && size_t(jas_matrix_numcols(m)) >= width)
+        return;
+
+      if (m)
+        jas_matrix_destroy(m);
+      m = jas_matrix_create(1, width);
+      if (!m)
+        throw bad_alloc();
+    }
+  };
+
   struct j2k_image
   {
     jas_image_t *m;
@@ -54,15 +88,30 @@ namespace
         throw runtime_error("failed to decode jpeg2000");
     }
 
-    image<uint8_t> operator()() const
+    void operator()(const j2k_decoder::target_fn &target, j2k_matrix &row, unsigned reduce, const j2k_region *region) const
     {
-      image<uint8_t> img(jas_image_numcmpts(m), jas_image_width(m), jas_image_height(m));
-      for (size_t y = 0; y != img.height(); ++y)
-        for (size_t x = 0; x != img.width(); ++x)
-          for (size_t c = 0; c != img.channels(); ++c)
-            img(c, x, y) = jas_image_readcmptsample(m, c, x, y);
+      // jasper cannot decode at reduced resolution or decode regions, so
+      // every 2^reduce-th sample of the region in the full image is taken
+      const size_t channels = jas_image_numcmpts(m), width = jas_image_width(m), height = jas_image_height(m);
+      const j2k_region r = j2k_clip_region(region, j2k_reduced_size(width, reduce), j2k_reduced_size(height, reduce));
+      const image_view<uint8_t> dst = target(channels, r.width, r.height);
+      if (r.width == 0)
+        return;
+
+      // full resolution columns covering the region
+      const size_t x0 = r.x << reduce, columns = min(width - x0, r.width << reduce);
+      row.resize(columns);
+      for (size_t c = 0; c != channels; ++c)
+        for (size_t y = 0; y != r.height; ++y)
+        {
+          if (jas_image_readcmpt(m, c, x0, (r.y + y) << reduce, columns, 1, row.m))
+            throw runtime_error("failed to read jpeg2000 component");
 
-      return img;
+          const jas_seqent_t *p = jas_matrix_getref(row.m, 0, 0);
+          uint8_t *q = &dst(0, y) + c;
+          for (size_t x = 0; x != r.width; ++x)
+            q[ptrdiff_t(x) * dst.xstride()] = uint8_t(p[x << reduce]);
+        }
     }
 
    ~j2k_image()
@@ -74,10 +123,35 @@ namespace
     j2k_image &operator=(const j2k_image &) = delete;
   };
 
+  /// jasper keeps global state and is not safe to use from several threads
+  mutex jasper_mutex;
+
+}
+
+/// row buffer kept between images
+struct j2k_decoder::impl
+{
+  j2k_matrix row;
+  unsigned reduce;
+};
+
+j2k_decoder::j2k_decoder(size_t, unsigned reduce)
+  : m(new impl)
+{
+  m->reduce = reduce;
+
+  static once_flag init;
+  call_once(init, []() { jas_init(); });
+}
+
+j2k_decoder::~j2k_decoder()
+{
+  lock_guard<mutex> lock(jasper_mutex);
+  m.reset();
 }
 
-image<uint8_t> decode_j2k(char *buf, size_t bufsize)
+void j2k_decoder::decode(const char *buf, size_t bufsize, const target_fn &target, const j2k_region *region)
 {
-  jas_init();
-  return j2k_image(j2k_stream(buf, bufsize))();
+  lock_guard<mutex> lock(jasper_mutex);
+  j2k_image(j2k_stream(buf, bufsize))(target, m->row, m->reduce, region);
 }
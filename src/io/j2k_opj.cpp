@@ -26,23 +26,23 @@ using namespace std;
 namespace
 {
 
-  struct j2k_decoder
+  struct j2k_codec
   {
     opj_dinfo_t *m;
-    j2k_decoder()
+    j2k_codec()
       : m(opj_create_decompress(CODEC_J2K))
     {
       if (!m)
         throw runtime_error("failed to create jpeg2000 decoder");
     }
 
-   ~j2k_decoder()
+   ~j2k_codec()
     {
       opj_destroy_decompress(m);
     }
 
-    j2k_decoder(const j2k_decoder &) = delete;
-    j2k_decoder &operator=(const j2k_decoder &) = delete;
+    j2k_codec(const j2k_codec &) = delete;
+    j2k_codec &operator=(const j2k_codec &) = delete;
 
     void setup(opj_dparameters &parameters)
     {
@@ -53,8 +53,8 @@ namespace
   struct j2k_stream
   {
     opj_cio_t *m;
-    j2k_stream(j2k_decoder &decoder, char *buf, size_t bufsize)
-      : m(opj_cio_open(reinterpret_cast<opj_common_ptr>(decoder.m), reinterpret_cast<unsigned char *>(buf), bufsize))
+    j2k_stream(j2k_codec &codec, const char *buf, size_t bufsize)
+      : m(opj_cio_open(reinterpret_cast<opj_common_ptr>(codec.m), reinterpret_cast<unsigned char *>(const_cast<char *>(buf)), bufsize))
     {
       if (!m)
         throw runtime_error("failed to create jpeg2000 stream");
@@ -72,8 +72,8 @@ namespace
   struct j2k_image
   {
     opj_image_t *m;
-    j2k_image(j2k_decoder &decoder, j2k_stream &stream)
-      : m(opj_decode(decoder.m, stream.m))
+    j2k_image(j2k_codec &codec, j2k_stream &stream)
+      : m(opj_decode(codec.m, stream.m))
     {
       if (!m)
         throw runtime_error("failed to decode jpeg2000 image");
@@ -87,28 +87,52 @@ namespace
     j2k_image(const j2k_image &) = delete;
     j2k_image &operator=(const j2k_image &) = delete;
 
-    image<uint8_t> operator()() const
+    void operator()(const j2k_decoder::target_fn &target, const j2k_region *region) const
     {
-      image<uint8_t> img(m->numcomps, m->x1 - m->x0, m->y1 - m->y0);
-      for (size_t y = 0; y != img.height(); ++y)
-        for (size_t x = 0; x != img.width(); ++x)
-          for (size_t c = 0; c != img.channels(); ++c)
-            img(c, x, y) = m->comps[c].data[y*img.width() + x];
-
-      return img;
+      // component sizes account for resolution reduction, regions are cut
+      // from the fully decoded image
+      const size_t width = m->numcomps ? m->comps[0].w : m->x1 - m->x0, height = m->numcomps ? m->comps[0].h : m->y1 - m->y0;
+      const j2k_region r = j2k_clip_region(region, width, height);
+      const image_view<uint8_t> dst = target(m->numcomps, r.width, r.height);
+
+      for (size_t c = 0; c != size_t(m->numcomps); ++c)
+      {
+        if (size_t(m->comps[c].w) != width || size_t(m->comps[c].h) != height || !m->comps[c].data)
+          throw runtime_error("unsupported jpeg2000 component layout");
+
+        narrow_j2k_component(m->comps[c].data + r.y * width + r.x, r.width, r.height, width, dst, c);
+      }
     }
   };
 
 }
 
-image<uint8_t> decode_j2k(char *buf, size_t bufsize)
+/// decoder parameters kept between images
+/**
+ * openjpeg 1.5 leaks coding parameters when a decompressor is reused, so
+ * one is created per image.
+ */
+struct j2k_decoder::impl
 {
-  j2k_decoder decoder;
-
   opj_dparameters_t parameters;
-  opj_set_default_decoder_parameters(&parameters);
-  decoder.setup(parameters);
+};
+
+j2k_decoder::j2k_decoder(size_t, unsigned reduce)
+  : m(new impl)
+{
+  opj_set_default_decoder_parameters(&m->parameters);
+  m->parameters.cp_reduce = reduce;
+}
+
+j2k_decoder::~j2k_decoder()
+{
+}
+
+void j2k_decoder::decode(const char *buf, size_t bufsize, const target_fn &target, const j2k_region *region)
+{
+  j2k_codec codec;
+  codec.setup(m->parameters);
 
-  j2k_stream stream(decoder, buf, bufsize);
-  return j2k_image(decoder, stream)();
+  j2k_stream stream(codec, buf, bufsize);
+  j2k_image(codec, stream)(target, region);
 }
@@ -32,7 +32,7 @@ namespace
 
   struct chunk_t
   {
-    char *buf;
+    const char *buf;
     size_t pos, size;
   };
 
@@ -62,10 +62,10 @@ namespace
   {
   }
 
-  struct j2k_decoder
+  struct j2k_codec
   {
     opj_codec_t *m;
-    j2k_decoder()
+    j2k_codec()
       : m(opj_create_decompress(OPJ_CODEC_J2K))
     {
       if (!m)
@@ -76,18 +76,26 @@ namespace
       opj_set_error_handler(m, print_callback, 0);
     }
 
-   ~j2k_decoder()
+   ~j2k_codec()
     {
       opj_destroy_codec(m);
     }
 
-    j2k_decoder(const j2k_decoder &) = delete;
-    j2k_decoder &operator=(const j2k_decoder &) = delete;
+    j2k_codec(const j2k_codec &) = delete;
+    j2k_codec &operator=(const j2k_codec &) = delete;
 
-    void setup(opj_dparameters &parameters)
+    void setup(opj_dparameters &parameters, size_t threads)
     {
       if (!opj_setup_decoder(m, &parameters))
         throw runtime_error("failed to setup jpeg2000 decoder");
+
+#if OPJ_VERSION_MAJOR > 2 || (OPJ_VERSION_MAJOR == 2 && OPJ_VERSION_MINOR >= 2)
+      // threading within the codestream, available since openjpeg 2.2
+      if (threads > 1)
+        opj_codec_set_threads(m, int(threads));
+#else
+      (void)threads;
+#endif
     }
   };
 
@@ -119,13 +127,14 @@ namespace
 
   struct j2k_image
   {
-    j2k_decoder &m_decoder;
+    j2k_codec &m_codec;
     j2k_stream &m_stream;
+    unsigned m_reduce;
     opj_image_t *m;
-    j2k_image(j2k_decoder &decoder, j2k_stream &stream)
-      : m_decoder(decoder), m_stream(stream)
+    j2k_image(j2k_codec &codec, j2k_stream &stream, unsigned reduce)
+      : m_codec(codec), m_stream(stream), m_reduce(reduce)
     {
-      if (!opj_read_header(m_stream.m, m_decoder.m, &m))
+      if (!opj_read_header(m_stream.m, m_codec.m, &m))
         throw runtime_error("failed to decode jpeg2000 header");
     }
 
@@ -137,32 +146,69 @@ namespace
     j2k_image(const j2k_image &) = delete;
     j2k_image &operator=(const j2k_image &) = delete;
 
-    image<uint8_t> operator()() const
+    void operator()(const j2k_decoder::target_fn &target, const j2k_region *region) const
     {
-      if (!opj_decode(m_decoder.m, m_stream.m, m) || !opj_end_decompress(m_decoder.m, m_stream.m))
+      // image area in reduced resolution as given by the component sizes
+      size_t width = j2k_reduced_size(m->x1, m_reduce) - j2k_reduced_size(m->x0, m_reduce);
+      size_t height = j2k_reduced_size(m->y1, m_reduce) - j2k_reduced_size(m->y0, m_reduce);
+      if (region)
+      {
+        // the decode area is given on the full resolution canvas
+        const j2k_region r = j2k_clip_region(region, width, height);
+        const OPJ_INT32 x0 = m->x0 + (r.x << m_reduce), y0 = m->y0 + (r.y << m_reduce);
+        const OPJ_INT32 x1 = min<OPJ_INT32>(m->x1, m->x0 + ((r.x + r.width) << m_reduce));
+        const OPJ_INT32 y1 = min<OPJ_INT32>(m->y1, m->y0 + ((r.y + r.height) << m_reduce));
+        if (!opj_set_decode_area(m_codec.m, m, x0, y0, x1, y1))
+          throw runtime_error("failed to set jpeg2000 decode area");
+
+        width = r.width;
+        height = r.height;
+      }
+      const image_view<uint8_t> dst = target(m->numcomps, width, height);
+
+      if (!opj_decode(m_codec.m, m_stream.m, m) || !opj_end_decompress(m_codec.m, m_stream.m))
         throw runtime_error("failed to decode jpeg2000 image");
 
-      image<uint8_t> img(m->numcomps, m->x1 - m->x0, m->y1 - m->y0);
-      for (size_t y = 0; y != img.height(); ++y)
-        for (size_t x = 0; x != img.width(); ++x)
-          for (size_t c = 0; c != img.channels(); ++c)
-            img(c, x, y) = m->comps[c].data[y*img.width()+x];
+      for (size_t c = 0; c != m->numcomps; ++c)
+      {
+        if (m->comps[c].w != width || m->comps[c].h != height || !m->comps[c].data)
+          throw runtime_error("unsupported jpeg2000 component layout");
 
-      return img;
+        narrow_j2k_component(m->comps[c].data, width, height, m->comps[c].w, dst, c);
+      }
     }
   };
 
 }
 
-image<uint8_t> decode_j2k(char *buf, size_t bufsize)
+/// decoder parameters kept between images
+/**
+ * openjpeg codecs and streams cannot be reset, so they are created per image.
+ */
+struct j2k_decoder::impl
 {
-  j2k_decoder decoder;
-
   opj_dparameters_t parameters;
-  opj_set_default_decoder_parameters(&parameters);
-  decoder.setup(parameters);
+  size_t threads;
+};
+
+j2k_decoder::j2k_decoder(size_t threads, unsigned reduce)
+  : m(new impl)
+{
+  opj_set_default_decoder_parameters(&m->parameters);
+  m->parameters.cp_reduce = reduce;
+  m->threads = threads;
+}
+
+j2k_decoder::~j2k_decoder()
+{
+}
+
+void j2k_decoder::decode(const char *buf, size_t bufsize, const target_fn &target, const j2k_region *region)
+{
+  j2k_codec codec;
+  codec.setup(m->parameters, m->threads);
 
   chunk_t c{buf, 0, bufsize};
   j2k_stream stream(c);
-  return j2k_image(decoder, stream)();
+  j2k_image(codec, stream, m->parameters.cp_reduce)(target, region);
 }
@@ -14,15 +14,24 @@
  * limitations under the License.
  */
 
+#include <qDebug>
+
 #include <algorithm>
+#include <chrono>
 #include <cstring>
+#include <list>
+#include <map>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
 #include <archive.h>
 #include <archive_entry.h>
 
 #include "../core/oct_data.hpp"
+#include "../core/parallel.hpp"
 #include "xml.hpp"
 
 using namespace std;
@@ -41,48 +50,67 @@ namespace
 
     eyetec_info(oct_subject &subject) : subject(subject) { }
 
-    void start(string &&name, const char **)
+    void start(const xml_name &name, const char **)
     {
       cur.clear();
-      if (name == "Contents")
+      if (name.hash() == xml_tag("Contents"))
         cur_paths.clear();
     }
 
-    void end(string &&name)
+    void end(const xml_name &name)
     {
-      if (name == "PatientNameGroup1")
+      switch (name.hash())
+      {
+      case xml_tag("PatientNameGroup1"):
         subject.info["name"] = cur;
-      else if (name == "PatientBirthDate")
+        break;
+      case xml_tag("PatientBirthDate"):
         subject.info["birth date"] = cur;
-      else if (name == "PatientSex")
+        break;
+      case xml_tag("PatientSex"):
         subject.info["sex"] = cur;
-      else if (name == "EthnicGroup")
+        break;
+      case xml_tag("EthnicGroup"):
         subject.info["ethnicity"] = cur;
-      else if (name == "ManufacturerModelName" || name == "DeviceSerialNumber" || name == "SoftwareVersion" || name == "SoftwareName")
-        subject.info[name] = cur;
-      else if (name == "SeriesNumber")
+        break;
+      case xml_tag("ManufacturerModelName"):
+      case xml_tag("DeviceSerialNumber"):
+      case xml_tag("SoftwareVersion"):
+      case xml_tag("SoftwareName"):
+        subject.info[name.c_str()] = cur;
+        break;
+      case xml_tag("SeriesNumber"):
         series_id = atoi(cur.c_str());
-      else if (name == "ContentLaterality")
+        break;
+      case xml_tag("ContentLaterality"):
         laterality = cur;
-      else if (name == "InstanceNumber")
+        break;
+      case xml_tag("InstanceNumber"):
         instance_id = atoi(cur.c_str());
-      else if (name == "ContentDateTime")
+        break;
+      case xml_tag("ContentDateTime"):
         content_date = cur;
-      else if (name == "Name")
+        break;
+      case xml_tag("Name"):
         path = cur;
-      else if (name == "Type")
+        break;
+      case xml_tag("Type"):
         type = cur;
-      else if (name == "FileDetails")
+        break;
+      case xml_tag("FileDetails"):
         cur_paths[path] = type;
-      else if (name == "Contents")
-      {
-        ostringstream o;
-        o << series_id << "." << instance_id;
-        oct_scan &s = subject.scans[o.str()];
-        s.info["scan date"] = content_date;
-        s.info["laterality"] = laterality;
-        for (auto &e: cur_paths)
-          paths[e.first] = make_pair(e.second, &s);
+        break;
+      case xml_tag("Contents"):
+        {
+          ostringstream o;
+          o << series_id << "." << instance_id;
+          oct_scan &s = subject.scans[o.str()];
+          s.info["scan date"] = content_date;
+          s.info["laterality"] = laterality;
+          for (auto &e: cur_paths)
+            paths[e.first] = make_pair(e.second, &s);
+        }
+        break;
       }
     }
 
@@ -92,234 +120,393 @@ namespace
     }
   };
 
-  char buf[10240];
-
-  ssize_t my_read(struct archive *, void *parent, const void **buffer)
+  /// gzip compressed payload, read from an archive entry or from memory
+  class payload_reader
   {
-    *buffer = buf;
-    return archive_read_data(static_cast<struct archive *>(parent), buf, 10240);
-  }
+    struct archive *a;
+    struct archive *m_parent; ///< archive with current entry to read, or null
+    char m_buf[1 << 16]; ///< compressed data read from parent
+    char m_scratch[1 << 16]; ///< destination of skipped data
 
-  int my_open(struct archive *, void *)
-  {
-    return ARCHIVE_OK;
-  }
+    static ssize_t read_parent(struct archive *, void *self, const void **buffer)
+    {
+      payload_reader &r = *static_cast<payload_reader *>(self);
+      *buffer = r.m_buf;
+      return archive_read_data(r.m_parent, r.m_buf, sizeof(r.m_buf));
+    }
 
-  int my_close(struct archive *, void *)
-  {
-    return ARCHIVE_OK;
-  }
+    void init()
+    {
+      if (!a)
+        throw runtime_error("failed to create archive reader");
 
-  void archive_read_skip_n(struct archive *a, size_t n)
-  {
-    char x;
-    while (n != 0)
-      archive_read_data(a, &x, 1), --n;
-  }
+      archive_read_support_filter_gzip(a);
+      archive_read_support_format_raw(a);
+    }
 
-  void read_contours(oct_scan &scan, struct archive *parent)
-  {
-    int r;
-    struct archive *a = archive_read_new();
-    archive_read_support_filter_gzip(a);
-    archive_read_support_format_raw(a);
-    r = archive_read_open(a, parent, my_open, my_read, my_close);
-    if (r != ARCHIVE_OK)
-      throw runtime_error(archive_error_string(a));
+    void check(int r)
+    {
+      if (r != ARCHIVE_OK)
+      {
+        string msg = archive_error_string(a) ? archive_error_string(a) : "failed to open payload";
+        archive_read_free(a);
+        throw runtime_error(msg);
+      }
+    }
 
-    struct archive_entry *entry;
-    while (archive_read_next_header(a, &entry) == ARCHIVE_OK)
+  public:
+
+    /// read current entry of parent archive
+    explicit payload_reader(struct archive *parent)
+      : a(archive_read_new()), m_parent(parent)
+    {
+      init();
+      check(archive_read_open(a, this, 0, read_parent, 0));
+    }
+
+    /// read buffered entry
+    explicit payload_reader(const vector<char> &data)
+      : a(archive_read_new()), m_parent(0)
+    {
+      init();
+      check(archive_read_open_memory(a, const_cast<char *>(data.data()), data.size()));
+    }
+
+   ~payload_reader()
+    {
+      archive_read_free(a);
+    }
+
+    payload_reader(const payload_reader &) = delete;
+    payload_reader &operator=(const payload_reader &) = delete;
+
+    /// advance to next payload
+    bool next()
+    {
+      struct archive_entry *entry;
+      return archive_read_next_header(a, &entry) == ARCHIVE_OK;
+    }
+
+    /// read given number of bytes
+    void read(void *p, size_t n)
+    {
+      while (n != 0)
+      {
+        ssize_t r = archive_read_data(a, p, n);
+        if (r < 0)
+          throw runtime_error(archive_error_string(a));
+        if (r == 0)
+          throw runtime_error("unexpected end of eyetec payload");
+
+        p = static_cast<char *>(p) + r;
+        n -= r;
+      }
+    }
+
+    /// fetch binary value
+    template <class T>
+    void fetch(T &t)
+    {
+      read(&t, sizeof(T));
+    }
+
+    /// skip given number of bytes
+    void skip(size_t n)
+    {
+      // gzip streams cannot seek, so data is read in large blocks; trailing
+      // padding may be missing at the end of the stream
+      while (n != 0)
+      {
+        ssize_t r = archive_read_data(a, m_scratch, min(n, sizeof(m_scratch)));
+        if (r < 0)
+          throw runtime_error(archive_error_string(a));
+        if (r == 0)
+          break;
+        n -= r;
+      }
+    }
+  };
+
+  void read_contours(oct_scan &scan, payload_reader &a)
+  {
+    while (a.next())
     {
       uint32_t width, height;
       for (size_t i = 0; i != 10; ++i)
       {
-        archive_read_skip_n(a, 4);
-        archive_read_data(a, &width, 4);
-        archive_read_data(a, &height, 4);
+        a.skip(4);
+        a.fetch(width);
+        a.fetch(height);
 
         ostringstream os;
         os << "CONTOUR" << i;
         image<float> &img = scan.contours[os.str()];
         img = image<float>(1, width, height);
 
-        archive_read_skip_n(a, 8);
+        a.skip(8);
         unique_ptr<uint16_t []> p(new uint16_t[width * height]);
-        archive_read_data(a, &p[0], width * height * sizeof(uint16_t));
+        a.read(&p[0], width * height * sizeof(uint16_t));
         transform(&p[0], &p[width*height], img.data(), [&](uint16_t v){return v / 1.7f;});
 
-        archive_read_skip_n(a, width * height + 128 + 4);
+        a.skip(width * height + 128 + 4);
       }
     }
-
-    archive_read_close(a);
-    r = archive_read_free(a);
-    if (r != ARCHIVE_OK)
-      throw runtime_error(archive_error_string(a));
   }
 
-  void read_fundus(oct_scan &scan, struct archive *parent)
+  void read_fundus(oct_scan &scan, payload_reader &a)
   {
-    int r;
-    struct archive *a = archive_read_new();
-    archive_read_support_filter_gzip(a);
-    archive_read_support_format_raw(a);
-    r = archive_read_open(a, parent, my_open, my_read, my_close);
-    if (r != ARCHIVE_OK)
-      throw runtime_error(archive_error_string(a));
-
-    struct archive_entry *entry;
-    while (archive_read_next_header(a, &entry) == ARCHIVE_OK)
+    while (a.next())
     {
       uint32_t width, height;
-      archive_read_skip_n(a, 4);
-      archive_read_data(a, &width, 4);
-      archive_read_data(a, &height, 4);
+      a.skip(4);
+      a.fetch(width);
+      a.fetch(height);
 
       // skip eye image
-      archive_read_skip_n(a, 16);
-      archive_read_skip_n(a, width * height);
+      a.skip(16);
+      a.skip(width * height);
 
-      archive_read_skip_n(a, 128);
-      archive_read_data(a, &width, 4);
-      archive_read_data(a, &height, 4);
+      a.skip(128);
+      a.fetch(width);
+      a.fetch(height);
 
       scan.fundus = image<uint8_t>(1, width, height);
 
-      archive_read_skip_n(a, 16);
-      archive_read_data(a, scan.fundus.data(), width * height);
+      a.skip(16);
+      a.read(scan.fundus.data(), width * height);
 
       scan.range.minx = 0;
       scan.range.maxx = width;
       scan.range.miny = 0;
       scan.range.maxy = height;
 
-      archive_read_skip_n(a, 128);
-      archive_read_data(a, &width, 4);
-      archive_read_data(a, &height, 4);
+      a.skip(128);
+      a.fetch(width);
+      a.fetch(height);
 
       // skip maximum intensity projection
-      archive_read_skip_n(a, 16);
-      archive_read_skip_n(a, width * height);
+      a.skip(16);
+      a.skip(width * height);
     }
-
-    archive_read_close(a);
-    r = archive_read_free(a);
-    if (r != ARCHIVE_OK)
-      throw runtime_error(archive_error_string(a));
   }
 
-  void read_volume(oct_scan &scan, struct archive *parent)
+  void read_volume(oct_scan &scan, payload_reader &a, bool pixels)
   {
-    int r;
-    struct archive *a = archive_read_new();
-    archive_read_support_filter_gzip(a);
-    archive_read_support_format_raw(a);
-    r = archive_read_open(a, parent, my_open, my_read, my_close);
-    if (r != ARCHIVE_OK)
-      throw runtime_error(archive_error_string(a));
-
-    struct archive_entry *entry;
-    while (archive_read_next_header(a, &entry) == ARCHIVE_OK)
+    while (a.next())
     {
       uint32_t width, height, depth;
-      archive_read_skip_n(a, 4);
-      archive_read_data(a, &width, 4);
-      archive_read_data(a, &height, 4);
-      archive_read_data(a, &depth, 4);
+      a.skip(4);
+      a.fetch(width);
+      a.fetch(height);
+      a.fetch(depth);
 
-      scan.tomogram = volume<uint8_t>(width, height, depth);
+      scan.dimensions[0] = width;
+      scan.dimensions[1] = height;
+      scan.dimensions[2] = depth;
 
       scan.size[0] =   12.0f;
       scan.size[1] = 0.0017f * height;
       scan.size[2] =    9.0f;
 
-      archive_read_skip_n(a, 24);
+      // metadata only needs the header
+      if (!pixels)
+        return;
+
+      scan.tomogram = volume<uint8_t>(width, height, depth);
+
+      a.skip(24);
       for (size_t z = 0; z != depth; ++z)
       {
-        archive_read_data(a, &scan.tomogram(0, 0, z), width * height);
-        archive_read_skip_n(a, 128 + 24);
+        a.read(&scan.tomogram(0, 0, z), width * height);
+        a.skip(128 + 24);
       }
     }
+  }
 
-    archive_read_close(a);
-    r = archive_read_free(a);
-    if (r != ARCHIVE_OK)
+  /// payload needed for given type?
+  bool wanted(const string &type, oct_payload payload)
+  {
+    return payload == oct_payload::all || type == "Tomograms" || (payload == oct_payload::contours && type == "AnalysedData");
+  }
+
+  /// read payload of given type
+  void read_payload(const string &type, oct_scan &scan, payload_reader &a, bool pixels)
+  {
+    if (type == "AnalysedData")
+      read_contours(scan, a);
+    else if (type == "Images")
+      read_fundus(scan, a);
+    else if (type == "Tomograms")
+      read_volume(scan, a, pixels);
+  }
+
+  /// move payload of given type decoded into part into scan
+  void merge_payload(const string &type, oct_scan &part, oct_scan &scan)
+  {
+    if (type == "AnalysedData")
+    {
+      for (auto &c: part.contours)
+        scan.contours[c.first] = move(c.second);
+    }
+    else if (type == "Images")
+    {
+      scan.fundus = move(part.fundus);
+      scan.range = part.range;
+    }
+    else if (type == "Tomograms")
+    {
+      scan.tomogram = move(part.tomogram);
+      copy(part.size, part.size + 3, scan.size);
+      copy(part.dimensions, part.dimensions + 3, scan.dimensions);
+    }
+  }
+
+  /// read data of current archive entry
+  void read_entry(struct archive *a, vector<char> &data)
+  {
+    char buf[1 << 16];
+    ssize_t size;
+    while ((size = archive_read_data(a, buf, sizeof(buf))) > 0)
+      data.insert(data.end(), buf, buf + size);
+    if (size < 0)
       throw runtime_error(archive_error_string(a));
   }
 
+  /// compressed payload entry, decoded on its own thread
+  struct payload_job
+  {
+    string name;
+    vector<char> data;
+    oct_scan part; ///< decoded payload, merged into the scan afterwards
+  };
+
   const char PATH_PREFIX[] = "PatientsFiles/";
   const char DB_PATH[] = "DBData.xml";
 
-  void load(const char *path, oct_subject &subject)
+  void load(const char *path, oct_subject &subject, const oct_load_options &options)
   {
+    // metadata is the database plus the tomogram headers
+    const bool pixels = options.payload == oct_payload::all;
+    const oct_payload payload = options.payload;
     eyetec_info info(subject);
+    bool have_info = false;
+
+    // payload entries are inflated concurrently from their compressed bytes
+    // if there are several cores, otherwise entries after the database are
+    // streamed directly from the archive
+    const bool concurrent = concurrency() > 1;
+    list<payload_job> jobs;
+    task_group tasks; // declared after jobs, so it waits before they are freed
+    size_t buffered = 0, buffered_bytes = 0;
+
+    auto run_job = [&](payload_job &job) {
+      const pair<string, oct_scan *> &target = info.paths.at(job.name);
+      tasks.run([&job, &target, pixels]() {
+        payload_reader p(job.data);
+        read_payload(target.first, job.part, p, pixels);
+        vector<char>().swap(job.data);
+      });
+    };
+
+    const auto start_time = chrono::steady_clock::now();
+    chrono::steady_clock::duration xml_time(0), read_time(0);
 
     int r;
     struct archive *a = archive_read_new();
-    archive_read_support_filter_none(a);
+    archive_read_support_filter_all(a);
     archive_read_support_format_zip(a);
-    r = archive_read_open_filename(a, path, 10240);
+    r = archive_read_open_filename(a, path, 1 << 16);
     if (r != ARCHIVE_OK)
       throw runtime_error(archive_error_string(a));
 
+    unique_ptr<struct archive, int (*)(struct archive *)> guard(a, archive_read_free);
+
     struct archive_entry *entry;
     while (archive_read_next_header(a, &entry) == ARCHIVE_OK)
     {
       if (strncmp(archive_entry_pathname(entry), PATH_PREFIX, strlen(PATH_PREFIX)) != 0)
         continue;
 
-      if (strcmp(archive_entry_pathname(entry) + strlen(PATH_PREFIX), DB_PATH) != 0)
-        continue;
-
-      using placeholders::_1;
-      using placeholders::_2;
-      char buf[1024];
-      xml x(bind(&eyetec_info::start, &info, _1, _2), bind(&eyetec_info::end, &info, _1), bind(&eyetec_info::data, &info, _1, _2));
-      while (true)
+      const char *name = archive_entry_pathname(entry) + strlen(PATH_PREFIX);
+      const auto t = chrono::steady_clock::now();
+      if (strcmp(name, DB_PATH) == 0)
       {
-        auto size = archive_read_data(a, buf, sizeof(buf));
-        if (size < 0)
-          throw runtime_error(archive_error_string(a));
-        x(buf, size, size == 0);
-        if (size == 0)
-          break;
+        char buf[1 << 16];
+        xml_parser<eyetec_info> x(info);
+        while (true)
+        {
+          auto size = archive_read_data(a, buf, sizeof(buf));
+          if (size < 0)
+            throw runtime_error(archive_error_string(a));
+          x(buf, size, size == 0);
+          if (size == 0)
+            break;
+        }
+        have_info = true;
+        xml_time += chrono::steady_clock::now() - t;
+
+        // decode entries seen before the database
+        for (auto i = jobs.begin(); i != jobs.end();)
+          if (info.paths.count(i->name) && wanted(info.paths.at(i->name).first, payload))
+            run_job(*i++);
+          else
+            i = jobs.erase(i);
+      }
+      else if (have_info)
+      {
+        auto i = info.paths.find(name);
+        if (i == info.paths.end() || !wanted(i->second.first, payload))
+          continue;
+
+        if (concurrent && payload != oct_payload::metadata)
+        {
+          jobs.push_back(payload_job{name, vector<char>(), oct_scan()});
+          read_entry(a, jobs.back().data);
+          run_job(jobs.back());
+        }
+        else
+        {
+          payload_reader p(a);
+          read_payload(i->second.first, *i->second.second, p, pixels);
+        }
+        read_time += chrono::steady_clock::now() - t;
+      }
+      else
+      {
+        // database not seen yet, keep the entry for later
+        jobs.push_back(payload_job{name, vector<char>(), oct_scan()});
+        read_entry(a, jobs.back().data);
+        ++buffered;
+        buffered_bytes += jobs.back().data.size();
+        read_time += chrono::steady_clock::now() - t;
       }
     }
 
     archive_read_close(a);
-    r = archive_read_free(a);
-    if (r != ARCHIVE_OK)
-      throw runtime_error(archive_error_string(a));
 
-    // reopen file
-    a = archive_read_new();
-    archive_read_support_filter_all(a);
-    archive_read_support_format_zip(a);
-    r = archive_read_open_filename(a, path, 10240);
-    if (r != ARCHIVE_OK)
-      throw runtime_error(archive_error_string(a));
-
-    while (archive_read_next_header(a, &entry) == ARCHIVE_OK)
+    const auto t = chrono::steady_clock::now();
+    tasks.wait();
+    for (payload_job &job: jobs)
     {
-      if (strncmp(archive_entry_pathname(entry), PATH_PREFIX, strlen(PATH_PREFIX)) != 0)
-        continue;
-
-      auto i = info.paths.find(archive_entry_pathname(entry) + strlen(PATH_PREFIX));
-      if (i == info.paths.end())
-        continue;
-
-      if (i->second.first == "AnalysedData")
-        read_contours(*i->second.second, a);
-      else if (i->second.first == "Images")
-        read_fundus(*i->second.second, a);
-      else if (i->second.first == "Tomograms")
-        read_volume(*i->second.second, a);
+      auto i = info.paths.find(job.name);
+      if (i != info.paths.end())
+        merge_payload(i->second.first, job.part, *i->second.second);
     }
+    const auto wait_time = chrono::steady_clock::now() - t;
 
-    r = archive_read_free(a);
-    if (r != ARCHIVE_OK)
-      throw runtime_error(archive_error_string(a));
+    typedef chrono::milliseconds ms;
+    qDebug() << "eyetec: database" << chrono::duration_cast<ms>(xml_time).count() << "ms, archive" << chrono::duration_cast<ms>(read_time).count()
+             << "ms, waiting for" << jobs.size() << "decoders" << chrono::duration_cast<ms>(wait_time).count() << "ms,"
+             << buffered << "entries (" << buffered_bytes / 1024 << "KiB) buffered, total"
+             << chrono::duration_cast<ms>(chrono::steady_clock::now() - start_time).count() << "ms";
+  }
+
+  bool probe(const char *head, size_t size)
+  {
+    // zip archive with patient files, DBData.xml need not be the first entry
+    const char *end = head + size;
+    return size >= 4 && memcmp(head, "PK\x03\x04", 4) == 0 && search(head, end, PATH_PREFIX, PATH_PREFIX + strlen(PATH_PREFIX)) != end;
   }
 
-  oct_reader r("Eyetec", {".exd"}, load);
+  oct_reader r("Eyetec", {".exd"}, load, probe);
 }
@@ -17,16 +17,21 @@
 #include <qDebug>
 
 #include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <cstring>
 #include <limits>
 #include <map>
+#include <memory>
 #include <iomanip>
 #include <sstream>
 #include <string>
 #include <vector>
 
 #include "../core/oct_data.hpp"
+#include "../core/parallel.hpp"
+#include "../core/slice_cache.hpp"
+#include "../core/view.hpp"
 #include "charconv.hpp"
 #include "file.hpp"
 
@@ -64,6 +69,112 @@ namespace
     }
   };
 
+  /// lookup table for converting ufloat16 bit patterns to 8 bit intensities
+  class ufloat16_table
+  {
+    uint8_t m_table[1 << 16];
+
+  public:
+
+    ufloat16_table()
+    {
+      for (uint32_t i = 0; i != (1 << 16); ++i)
+      {
+        const uint16_t bits = i;
+        ufloat16 v;
+        memcpy(&v, &bits, sizeof(v));
+        m_table[i] = [](const ufloat16 &v) -> uint8_t { return 256 * pow(v, 1.0f / 2.4f); }(v);
+      }
+    }
+
+    uint8_t operator()(uint16_t v) const
+    {
+      return m_table[v];
+    }
+
+    /// shared table, built on first use
+    static const ufloat16_table &get()
+    {
+      static const ufloat16_table table;
+      return table;
+    }
+  };
+
+  static_assert(sizeof(ufloat16) == sizeof(uint16_t), "unexpected ufloat16 layout");
+
+  /// convert B-scan of ufloat16 bit patterns
+  void convert_bscan(const image_view<const uint16_t> &src, const image_view<uint8_t> &dst)
+  {
+    const ufloat16_table &table = ufloat16_table::get();
+    if (src.xstride() == 1 && dst.xstride() == 1)
+    {
+      // contiguous rows, simple loop the compiler unrolls well
+      for (size_t y = 0; y != src.height(); ++y)
+      {
+        const uint16_t *p = &src(0, y);
+        uint8_t *q = &dst(0, y);
+        for (size_t x = 0; x != src.width(); ++x)
+          q[x] = table(p[x]);
+      }
+    }
+    else
+      transform(src, dst, table);
+  }
+
+  /// B-scans left in the file, converted when read
+  class e2e_slices
+    : public slice_source
+  {
+    shared_ptr<const file> m_file;
+    vector<uint64_t> m_offsets; ///< file offset of each slice, 0 if missing
+    size_t m_width, m_height;
+
+  public:
+
+    e2e_slices(const shared_ptr<const file> &f, vector<uint64_t> &&offsets, size_t width, size_t height)
+      : m_file(f), m_offsets(move(offsets)), m_width(width), m_height(height)
+    {
+    }
+
+    size_t width() const override
+    {
+      return m_width;
+    }
+
+    size_t height() const override
+    {
+      return m_height;
+    }
+
+    size_t depth() const override
+    {
+      return m_offsets.size();
+    }
+
+    void read(size_t z, size_t x, size_t y, const image_view<uint8_t> &dst) override
+    {
+      if (z >= depth() || x > m_width || dst.width() > m_width - x || y > m_height || dst.height() > m_height - y)
+        throw runtime_error("slice region out of range");
+
+      // missing slices are black
+      if (m_offsets[z] == 0)
+      {
+        for (size_t v = 0; v != dst.height(); ++v)
+          for (size_t u = 0; u != dst.width(); ++u)
+            dst(u, v) = 0;
+        return;
+      }
+
+      // read full rows, convert the requested columns
+      vector<uint16_t> rows(m_width * dst.height());
+      const size_t n = rows.size() * sizeof(uint16_t);
+      if (m_file->read_at(m_offsets[z] + uint64_t(y) * m_width * sizeof(uint16_t), rows.data(), n) != n)
+        throw runtime_error("read slice error");
+
+      convert_bscan(image_view<const uint16_t>(rows.data(), m_width, dst.height()).sub(x, 0, dst.width(), dst.height()), dst);
+    }
+  };
+
   typedef struct
   {
     char magic[12];
@@ -94,20 +205,57 @@ namespace
     uint32_t tag, id;
   } chunk_t;
 
+  /// chunk position and payload size from directory
+  typedef struct
+  {
+    uint32_t start, size;
+  } chunk_ref_t;
+
+  bool operator<(const chunk_ref_t &a, const chunk_ref_t &b)
+  {
+    return a.start < b.start;
+  }
+
+  /// consecutive chunks read at once
+  typedef struct
+  {
+    uint64_t begin, end; ///< byte range relative to header
+    size_t first, last; ///< chunk indices
+  } chunk_run_t;
+
+  /// largest gap between chunks read over instead of seeking
+  const uint64_t max_run_gap = 64 << 10;
+
+  /// largest run read at once, unless a single chunk is larger
+  const uint64_t max_run_size = 16 << 20;
+
   const char magic1[] = {0x43, 0x4D, 0x44, 0x62, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
   const char magic2[] = {0x4D, 0x44, 0x62, 0x4D, 0x44, 0x69, 0x72, 0x00, 0x00, 0x00, 0x00, 0x00};
   const char magic3[] = {0x4D, 0x44, 0x62, 0x44, 0x69, 0x72, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
   const char magic4[] = {0x4D, 0x44, 0x62, 0x44, 0x61, 0x74, 0x61, 0x00, 0x00, 0x00, 0x00, 0x00};
 
-  void load(const char *path, oct_subject &subject)
+  const uint32_t image_tag = 0x40000000;
+  const uint32_t contour_tag = 0x00002723;
+  const uint32_t patient_tag = 0x00000009;
+  const uint32_t laterality_tag = 0x0000000B;
+
+  /// size of image chunk header before the pixels
+  const uint32_t image_header_size = 5 * sizeof(uint32_t);
+
+  void load(const char *path, oct_subject &subject, const oct_load_options &options)
   {
+    const bool pixels = options.payload == oct_payload::all;
+    const bool contours = options.payload != oct_payload::metadata;
+    const bool deferred = pixels && (options.cache_bytes != 0 || options.progressive); // slices decoded after loading
     map<string, oct_scan> &scans = subject.scans;
     map<string, string> &info = subject.info;
 
-    file f(path, "r+b");
+    const auto start_time = chrono::steady_clock::now();
+    shared_ptr<file> fp = make_shared<file>(path, "rbm");
+    file &f = *fp;
     
-    //ignore information before header
-    f.ignoreUntil("CMDb");
+    //ignore information before header, all offsets are relative to it
+    const uint64_t base = f.ignoreUntil("CMDb");
     
     mdb_header_t h;
     f.fetch(h);
@@ -125,7 +273,7 @@ namespace
     do
     {
       dirs.push_back(cur);
-      f.set(dirs.back());
+      f.set(base + dirs.back());
       f.fetch(d);
       if (strncmp(d.magic, magic3, sizeof(magic3)) != 0 || d.v_100 != 100)
         throw runtime_error("error reading e2e directory");
@@ -134,11 +282,11 @@ namespace
     } while (cur != 0);
 
     // get all chunks by traversing all dirs
-    vector<uint32_t> chunks;
+    vector<chunk_ref_t> chunks;
     map<uint32_t, uint32_t> num_slices;
     while (!dirs.empty())
     {
-      f.set(dirs.back());
+      f.set(base + dirs.back());
       f.fetch(d);
       dirs.pop_back();
 
@@ -150,136 +298,246 @@ namespace
         if (e.series_id != 0xffffffff)
           num_slices[e.series_id] = max(num_slices[e.series_id], (e.slice_id + 2) / 2);
 
-        if (e.start > e.pos)
-          chunks.push_back(e.start);
+        if (e.start <= e.pos)
+          continue;
+
+        // skip chunks of unselected series, but not those of the patient
+        if (!options.scans.empty() && e.series_id != 0xffffffff && !options.scans.count(to_string(e.series_id)))
+          continue;
+
+        // for metadata only patient and laterality chunks and image headers,
+        // out of core all but the image data, which is read when shown
+        if (pixels && !deferred)
+          chunks.push_back({e.start, e.size});
+        else if (e.tag == image_tag)
+          chunks.push_back({e.start, min(e.size, image_header_size)});
+        else if (pixels || e.tag == patient_tag || e.tag == laterality_tag || (contours && e.tag == contour_tag))
+          chunks.push_back({e.start, e.size});
       }
     }
 
-    for (uint32_t pos: chunks)
+    // visit chunks in file order and coalesce nearby ones into single reads
+    sort(chunks.begin(), chunks.end());
+    chunks.erase(unique(chunks.begin(), chunks.end(), [](const chunk_ref_t &a, const chunk_ref_t &b) { return a.start == b.start; }), chunks.end());
+
+    vector<chunk_run_t> runs;
+    for (size_t i = 0; i != chunks.size(); ++i)
+    {
+      const uint64_t begin = chunks[i].start, end = begin + sizeof(chunk_t) + chunks[i].size;
+      if (!runs.empty() && begin <= runs.back().end + max_run_gap && end - runs.back().begin <= max_run_size)
+      {
+        runs.back().end = max(runs.back().end, end);
+        runs.back().last = i + 1;
+      }
+      else
+        runs.push_back({begin, end, i, i + 1});
+    }
+
+    task_group tasks;
+    map<uint32_t, vector<uint64_t>> slice_offsets; ///< slices per series, out of core
+    uint64_t bytes_read = 0;
+    vector<char> buf;
+    if (!runs.empty())
+      f.advise(base + runs[0].begin, runs[0].end - runs[0].begin);
+
+    for (size_t i = 0; i != runs.size(); ++i)
     {
-      f.set(pos);
-      chunk_t c;
-      if (!f.fetch(c))
-        throw runtime_error("read chunk error");
+      const chunk_run_t &run = runs[i];
+      if (i + 1 != runs.size())
+        f.advise(base + runs[i + 1].begin, runs[i + 1].end - runs[i + 1].begin);
 
-      if (strncmp(c.magic, magic4, sizeof(magic4)) != 0)
-        throw runtime_error("chunk header error");
+      // mapped files are read in place, others get one read per run
+      size_t buf_size = run.end - run.begin;
+      if (!f.data())
+      {
+        buf.resize(buf_size);
+        buf_size = f.read_at(base + run.begin, buf.data(), buf.size());
+      }
+      bytes_read += buf_size;
 
-      if (c.tag == 0x40000000) // image data
+      for (size_t k = run.first; k != run.last; ++k)
       {
-        ostringstream o;
-        o << c.series_id;
-        oct_scan &s = scans[o.str()];
-        uint32_t size, x, y, height, width;
-        f.fetch(size);
-        f.fetch(x);
-        f.fetch(y);
-        f.fetch(height);
-        f.fetch(width);
-
-        if (c.ind == 0) // fundus image
+        file_cursor r(f, base + chunks[k].start);
+        if (!f.data())
+          r.buffer(buf.data(), base + run.begin, buf_size);
+
+        chunk_t c;
+        if (!r.fetch(c))
+          throw runtime_error("read chunk error");
+
+        if (strncmp(c.magic, magic4, sizeof(magic4)) != 0)
+          throw runtime_error("chunk header error");
+
+        if (c.tag == image_tag) // image data
         {
-          s.fundus = image<uint8_t>(1, width, height);
-          f.read(s.fundus.data(), width * height);
-
-          // guessed from XML files
-          s.range.minx = width / 6;
-          s.range.maxx = 5 * width / 6;
-          s.range.miny = height / 4;
-          s.range.maxy = 3 * height / 4;
-
-          s.size[0] = 6;
-          s.size[1] = 492 * 0.0039;
-          s.size[2] = 4.5;
+          ostringstream o;
+          o << c.series_id;
+          oct_scan &s = scans[o.str()];
+          uint32_t size, x, y, height, width;
+          r.fetch(size);
+          r.fetch(x);
+          r.fetch(y);
+          r.fetch(height);
+          r.fetch(width);
+
+          if (c.ind == 0) // fundus image
+          {
+            if (pixels)
+            {
+              s.fundus = image<uint8_t>(1, width, height);
+              r.read(s.fundus.data(), width * height);
+            }
+
+            // guessed from XML files
+            s.range.minx = width / 6;
+            s.range.maxx = 5 * width / 6;
+            s.range.miny = height / 4;
+            s.range.maxy = 3 * height / 4;
+
+            s.size[0] = 6;
+            s.size[1] = 492 * 0.0039;
+            s.size[2] = 4.5;
+          }
+          else if (!pixels)
+          {
+            s.dimensions[0] = width;
+            s.dimensions[1] = height;
+            s.dimensions[2] = num_slices[c.series_id];
+          }
+          else // normal image
+          {
+            if (c.slice_id > num_slices[c.series_id] * 2)
+              throw runtime_error("broken slice sequence");
+
+            if (deferred)
+            {
+              vector<uint64_t> &offsets = slice_offsets[c.series_id];
+              if (offsets.empty())
+              {
+                offsets.resize(num_slices[c.series_id]);
+                s.dimensions[0] = width;
+                s.dimensions[1] = height;
+                s.dimensions[2] = num_slices[c.series_id];
+              }
+              else if (s.dimensions[0] != width || s.dimensions[1] != height)
+                throw runtime_error("inconsistent slice size");
+
+              // flipped like the loaded tomogram
+              if (c.slice_id / 2 < offsets.size())
+                offsets[offsets.size() - 1 - c.slice_id / 2] = r.pos();
+              continue;
+            }
+
+            if (!s.tomogram.data())
+              s.tomogram = volume<uint8_t>(width, height, num_slices[c.series_id]);
+            else if (s.tomogram.width() != width || s.tomogram.height() != height)
+              throw runtime_error("inconsistent slice size");
+
+            // mapped slices are converted in place, others are copied first
+            shared_ptr<const uint16_t> p;
+            const size_t n = size_t(width) * height;
+            if (f.data() && r.pos() <= f.size() && n <= (f.size() - r.pos()) / sizeof(uint16_t) && r.pos() % alignof(uint16_t) == 0)
+              p = shared_ptr<const uint16_t>(reinterpret_cast<const uint16_t *>(f.data() + r.pos()), [](const uint16_t *) {});
+            else
+            {
+              shared_ptr<uint16_t> q(new uint16_t[n], default_delete<uint16_t []>());
+              if (r.read(q.get(), n) != n)
+                throw runtime_error("read slice error");
+              p = q;
+            }
+
+            // convert and flip on a worker while reading on
+            const image_view<uint8_t> dst = view(s.tomogram).flip_z().slice(c.slice_id / 2);
+            tasks.run([p, width, height, dst]() { convert_bscan(image_view<const uint16_t>(p.get(), width, height), dst); });
+          }
         }
-        else // normal image
+        else if (c.tag == contour_tag) // contour data
         {
+          ostringstream o;
+          o << c.series_id;
+          oct_scan &s = scans[o.str()];
           if (c.slice_id > num_slices[c.series_id] * 2)
             throw runtime_error("broken slice sequence");
 
-          if (!s.tomogram.data())
-            s.tomogram = volume<uint8_t>(width, height, num_slices[c.series_id]);
+          uint32_t dummy, name, width;
+          r.fetch(dummy);
+          r.fetch(name);
+          r.fetch(dummy);
+          r.fetch(width);
 
-          unique_ptr<ufloat16 []> p(new ufloat16[width*height]);
-          f.read(p.get(), width*height);
+          ostringstream os;
+          os << "CONTOUR" << name;
 
-          // convert and flip
-          uint8_t *q = &s.tomogram(0, 0, num_slices[c.series_id] - 1 - c.slice_id / 2);
-          for (size_t y = 0; y != height; ++y)
-            for (size_t x = 0; x != width; ++x)
-              *q++ = 256 * pow(p[y*width+x], 1.0f / 2.4f);
-        }
-      }
-      else if (c.tag == 0x00002723) // contour data
-      {
-        ostringstream o;
-        o << c.series_id;
-        oct_scan &s = scans[o.str()];
-        if (c.slice_id > num_slices[c.series_id] * 2)
-          throw runtime_error("broken slice sequence");
-
-        uint32_t dummy, name, width;
-        f.fetch(dummy);
-        f.fetch(name);
-        f.fetch(dummy);
-        f.fetch(width);
-
-        ostringstream os;
-        os << "CONTOUR" << name;
-
-        image<float> &img = s.contours[os.str()];
-        if (!img.data())
-          img = image<float>(1, width, num_slices[c.series_id]);
-
-        unique_ptr<float []> p(new float[width]);
-        f.read(p.get(), width);
-
-        // convert and flip contours
-        float *q = &img(0, num_slices[c.series_id] - 1 - c.slice_id / 2);
-        for (size_t x = 0; x != width; ++x)
-          *q++ = (p[x] != numeric_limits<float>::max() && p[x] != 0.0 ? p[x] : 0.0 / 0.0); // simple hack to drop triangles using invalid values
-      }
-      else if (c.tag == 0x00000009)
-      {
-        char s[67]; uint32_t birthday;
-        f.read(s, 31);
-        s[31] = 0;
-        info["name"] = latin1_to_utf8(s);
+          image<float> &img = s.contours[os.str()];
+          if (!img.data())
+            img = image<float>(1, width, num_slices[c.series_id]);
 
-        f.read(s, 66); s[66] = 0;
-        if (strlen(s))
-          info["name"] = latin1_to_utf8(s) + ", " + info["name"];
+          unique_ptr<float []> p(new float[width]);
+          r.read(p.get(), width);
 
-        f.fetch(birthday);
+          // convert and flip contours
+          transform(image_view<const float>(p.get(), width, 1), view(img).flip_y().sub(0, c.slice_id / 2, width, 1),
+            [](float v) -> float { return (v != numeric_limits<float>::max() && v != 0.0 ? v : 0.0 / 0.0); }); // simple hack to drop triangles using invalid values
+        }
+        else if (c.tag == patient_tag)
         {
-          int year, month, day;
+          char s[67]; uint32_t birthday;
+          r.read(s, 31);
+          s[31] = 0;
+          info["name"] = latin1_to_utf8(s);
+
+          r.read(s, 66); s[66] = 0;
+          if (strlen(s))
+            info["name"] = latin1_to_utf8(s) + ", " + info["name"];
+
+          r.fetch(birthday);
+          {
+            int year, month, day;
+            ostringstream o;
+            o.fill('0');
+            date(birthday/64 - 14558805, year, month, day);
+            o << year << "/" << setw(2) << month << "/" << setw(2) << day;
+            info["birth date"] = o.str();
+          }
+
+          r.read(s, 1);
+          s[1] = 0;
+          info["sex"] = s;
+
           ostringstream o;
-          o.fill('0');
-          date(birthday/64 - 14558805, year, month, day);
-          o << year << "/" << setw(2) << month << "/" << setw(2) << day;
-          info["birth date"] = o.str();
+          o << c.patient_id;
+          info["ID"] = o.str();
+        }
+        else if (c.tag == laterality_tag)
+        {
+          ostringstream o;
+          o << c.series_id;
+          oct_scan &s = scans[o.str()];
+          char v[14];
+          r.fetch(v);
+          r.read(v, 1); v[1] = 0;
+          s.info["laterality"] = latin1_to_utf8(v);
         }
-
-        f.read(s, 1);
-        s[1] = 0;
-        info["sex"] = s;
-
-        ostringstream o;
-        o << c.patient_id;
-        info["ID"] = o.str();
-      }
-      else if (c.tag == 0x0000000B)
-      {
-        ostringstream o;
-        o << c.series_id;
-        oct_scan &s = scans[o.str()];
-        char v[14];
-        f.fetch(v);
-        f.read(v, 1); v[1] = 0;
-        s.info["laterality"] = latin1_to_utf8(v);
       }
     }
+    tasks.wait();
+
+    for (auto &o: slice_offsets)
+    {
+      oct_scan &s = scans[to_string(o.first)];
+      s.slices = make_shared<e2e_slices>(fp, move(o.second), s.dimensions[0], s.dimensions[1]);
+      if (options.cache_bytes != 0)
+        s.slices = make_shared<slice_cache>(s.slices, options.cache_bytes);
+    }
+
+    qDebug() << "e2e:" << chunks.size() << "chunks in" << runs.size() << "reads," << bytes_read / (1 << 20) << "MiB in"
+             << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time).count() << "ms";
+  }
+
+  bool probe(const char *head, size_t size)
+  {
+    return file::find(head, size, "CMDb", 4) != 0;
   }
 
-  oct_reader regist("Heidelberg Spectralis OCT", {".e2e", ".E2E"}, load);
+  oct_reader regist("Heidelberg Spectralis OCT", {".e2e", ".E2E"}, load, probe);
 }
@@ -19,8 +19,17 @@
 #include <iomanip>
 #include <stdexcept>
 #include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "../core/oct_data.hpp"
+#include "../core/parallel.hpp"
+#include "../core/slice_cache.hpp"
+#include "../core/view.hpp"
 #include "file.hpp"
 #include "xml.hpp"
 
@@ -29,61 +38,170 @@ using namespace std;
 namespace
 {
 
-  void mystart(string &cur, string &&, const char **)
+  /// scan info from xml description
+  struct nidek_info
   {
-    cur.clear();
-  }
+    map<string, string> &m;
+    string cur;
+
+    explicit nidek_info(map<string, string> &m) : m(m) { }
 
-  void myend(map<string, string> &m, string &cur, const string &name)
+    void start(const xml_name &, const char **)
+    {
+      cur.clear();
+    }
+
+    void end(const xml_name &name)
+    {
+      switch (name.hash())
+      {
+      case xml_tag("ScanType"):
+      case xml_tag("ScanPointB"):
+      case xml_tag("ScanWidth2"):
+        if (m["ScanPattern"] != "MaculaMap")
+          break;
+        // only stored for macula maps, fall through
+      case xml_tag("Serial"):
+      case xml_tag("Version"):
+      case xml_tag("Model"):
+      case xml_tag("Product"):
+      case xml_tag("Manufacture"):
+      case xml_tag("ScanPattern"):
+      case xml_tag("ScanPointA"):
+      case xml_tag("ScanCenterX"):
+      case xml_tag("ScanCenterY"):
+      case xml_tag("ScanWidth1"):
+      case xml_tag("OCTDepthResolution"):
+      case xml_tag("SLOPixelSpacing"):
+      case xml_tag("CCDPixelSpacing"):
+        m[name.c_str()] = cur;
+        break;
+      case xml_tag("Eye"):
+        m["laterality"] = cur;
+        break;
+      case xml_tag("ReleaseDate"):
+        m["scan date"] = cur;
+        break;
+      }
+    }
+
+    void data(const char *data, size_t len)
+    {
+      cur.append(data, len);
+    }
+  };
+
+  /// read bmp header, gives offset of pixel data
+  uint32_t read_bmp_header(const file &f, uint32_t &width, uint32_t &height)
   {
-    if (name == "Serial" || name == "Version" || name == "Model" ||
-        name == "Product" || name == "Manufacture" ||
-        name == "ScanPattern" || name == "ScanPointA" || name == "ScanCenterX" ||
-        name == "ScanCenterY" || name == "ScanWidth1" ||
-        name == "OCTDepthResolution" || name == "SLOPixelSpacing" || name == "CCDPixelSpacing" ||
-        (m["ScanPattern"] == "MaculaMap" && (name == "ScanType" || name == "ScanPointB" || name == "ScanWidth2")))
-      m[name] = cur;
-    else if (name == "Eye")
-      m["laterality"] = cur;
-    else if (name == "ReleaseDate")
-      m["scan date"] = cur;
+    uint32_t start;
+    if (!f.fetch_at(10, start) || !f.fetch_at(18, width) || !f.fetch_at(22, height))
+      throw runtime_error("could not read bmp header");
+
+    return start;
   }
 
-  void mydata(string &cur, const char *data, size_t len)
+  /// read and flip bmp image into given view
+  void read_bmp(const file &f, const image_view<uint8_t> &dst)
   {
-    cur.append(data, len);
+    uint32_t width, height;
+    const uint32_t start = read_bmp_header(f, width, height);
+    if (width != dst.width() || height != dst.height())
+      throw runtime_error("size mismatch in bmp image");
+
+    if (f.data() && start <= f.size() && width * height <= f.size() - start)
+      copy(image_view<const uint8_t>(reinterpret_cast<const uint8_t *>(f.data() + start), width, height).flip_y(), dst);
+    else
+    {
+      for (size_t y = 0; y != height; ++y)
+        f.read_at(start + uint64_t(y) * width, &dst(0, height - 1 - y), width);
+    }
   }
 
   image<uint8_t> read_bmp(const string &path)
   {
-    uint32_t start, width, height;
+    uint32_t width, height;
 
-    file f(path.c_str(), "rb");
-    f.set(10);
-    f.fetch(start);
-    f.set(18);
-    f.fetch(width);
-    f.fetch(height);
+    file f(path.c_str(), "rbm");
+    read_bmp_header(f, width, height);
 
     image<uint8_t> img(1, width, height);
+    read_bmp(f, view(img));
+    return img;
+  }
 
-    // read and flip image
-    f.set(start);
-    for (size_t y = 0; y != height; ++y)
-      f.read(&img(0, height - 1 - y), width);
+  /// slices in separate bmp files, read on demand
+  class bmp_slices
+    : public slice_source
+  {
+    vector<string> m_paths;
+    size_t m_width, m_height;
 
-    return img;
+  public:
+
+    bmp_slices(vector<string> &&paths, size_t width, size_t height)
+      : m_paths(move(paths)), m_width(width), m_height(height)
+    {
+    }
+
+    size_t width() const override
+    {
+      return m_width;
+    }
+
+    size_t height() const override
+    {
+      return m_height;
+    }
+
+    size_t depth() const override
+    {
+      return m_paths.size();
+    }
+
+    void read(size_t z, size_t x, size_t y, const image_view<uint8_t> &dst) override
+    {
+      if (z >= depth())
+        throw runtime_error("slice index out of range");
+
+      file f(m_paths[z].c_str(), "rbm");
+      if (x == 0 && y == 0 && dst.width() == m_width && dst.height() == m_height)
+        read_bmp(f, dst);
+      else
+      {
+        image<uint8_t> img(1, m_width, m_height);
+        read_bmp(f, view(img));
+        copy(image_view<const uint8_t>(view(img)).sub(x, y, dst.width(), dst.height()), dst);
+      }
+    }
+  };
+
+  /// convert row of contour values
+  void widen_contour(const uint16_t *src, float *dst, size_t n)
+  {
+    size_t x = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 8 <= n; x += 8)
+    {
+      const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x));
+      _mm_storeu_ps(dst + x, _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)));
+      _mm_storeu_ps(dst + x + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)));
+    }
+#endif
+    for (; x != n; ++x)
+      dst[x] = src[x];
   }
 
-  void load(const char *path, oct_subject &subject)
+  void load(const char *path, oct_subject &subject, const oct_load_options &options)
   {
+    const bool pixels = options.payload == oct_payload::all;
+    const bool contours = options.payload != oct_payload::metadata;
     oct_scan &scan = subject.scans[""];
     {
-      using placeholders::_1;
-      using placeholders::_2;
-      file f(path, "rb");
-      string cur;
-      xml x(bind(::mystart, ref(cur), _1, _2), bind(::myend, ref(scan.info), ref(cur), _1), bind(::mydata, ref(cur), _1, _2));
+      file f(path, "rbm");
+      nidek_info info(scan.info);
+      xml_parser<nidek_info> x(info);
       char buf[1024];
       while (f)
       {
@@ -94,7 +212,8 @@ namespace
 
     string base(path, 0, strlen(path) - 5); // remove "x.xml"
 
-    scan.fundus = read_bmp(base + ".bmp");
+    if (pixels)
+      scan.fundus = read_bmp(base + ".bmp");
 
     if (scan.info["ScanPattern"] == "MaculaMap")
     {
@@ -103,34 +222,63 @@ namespace
 
       size_t num_slices = atoi(scan.info["ScanPointB"].c_str());
       scan.info.erase(scan.info.find("ScanPointB"));
+
+      vector<string> paths(num_slices);
       for (size_t i = 0; i != num_slices; ++i)
       {
         ostringstream os;
         os.fill('0');
         os << base << "oct_c_" << setw(3) << i + 1 << ".bmp";
-        image<uint8_t> img = read_bmp(os.str());
+        paths[i] = os.str();
+      }
+
+      if (num_slices != 0)
+      {
+        uint32_t width, height;
+        read_bmp_header(file(paths[0].c_str(), "rbm"), width, height);
+        scan.dimensions[0] = width;
+        scan.dimensions[1] = height;
+        scan.dimensions[2] = num_slices;
 
-        if (i == 0)
-          scan.tomogram = volume<uint8_t>(img.width(), img.height(), num_slices);
-        else
+        if (pixels && (options.cache_bytes != 0 || options.progressive))
         {
-          if (img.width() != scan.tomogram.width() || img.height() != scan.tomogram.height())
-            throw runtime_error("size mismatch in bmp image");
+          // slices are read later
+          scan.slices = make_shared<bmp_slices>(move(paths), width, height);
+          if (options.cache_bytes != 0)
+            scan.slices = make_shared<slice_cache>(scan.slices, options.cache_bytes);
         }
+        else if (pixels)
+        {
+          scan.tomogram = volume<uint8_t>(width, height, num_slices);
 
-        copy_n(&img(0, 0), img.width() * img.height(), &scan.tomogram(0, 0, i));
+          // slices are separate files, map and decode them concurrently
+          volume_view<uint8_t> dst = view(scan.tomogram);
+          parallel_for(0, num_slices, [&](size_t z) {
+            file f(paths[z].c_str(), "rbm");
+            read_bmp(f, dst.slice(z));
+          });
+        }
       }
     }
     else
     {
       scan.size[2] = 0;
-      auto img = read_bmp(base + "oct_c_xh1.bmp");
-      scan.tomogram = volume<uint8_t>(img.width(), img.height(), 1);
-      copy_n(&img(0, 0), img.width() * img.height(), &scan.tomogram(0, 0, 0));
+      uint32_t width, height;
+      file f((base + "oct_c_xh1.bmp").c_str(), "rbm");
+      read_bmp_header(f, width, height);
+      scan.dimensions[0] = width;
+      scan.dimensions[1] = height;
+      scan.dimensions[2] = 1;
+
+      if (pixels)
+      {
+        scan.tomogram = volume<uint8_t>(width, height, 1);
+        read_bmp(f, view(scan.tomogram).slice(0));
+      }
     }
 
     scan.size[0] = atof(scan.info["ScanWidth1"].c_str()) * 0.3f;
-    scan.size[1] = atof(scan.info["OCTDepthResolution"].c_str()) * scan.tomogram.height() / 1000.0f;
+    scan.size[1] = atof(scan.info["OCTDepthResolution"].c_str()) * scan.dimensions[1] / 1000.0f;
     scan.info.erase(scan.info.find("ScanWidth1"));
     scan.info.erase(scan.info.find("OCTDepthResolution"));
 
@@ -144,36 +292,62 @@ namespace
     scan.info.erase(scan.info.find("CCDPixelSpacing"));
     scan.info.erase(scan.info.find("ScanPointA"));
 
-    file f((base + "oct_m.dat").c_str(), "rb");
+    if (!contours)
+      return;
+
+    file f((base + "oct_m.dat").c_str(), "rbm");
 
     uint32_t num_slices, num_contours, size;
     f.set(24);
     f.fetch(num_slices);
-    if (num_slices != scan.tomogram.depth())
+    if (num_slices != scan.dimensions[2])
       throw runtime_error("unexpected number of slices");
 
     f.fetch(size);
-    num_contours = (size - 12) / sizeof(uint16_t) / scan.tomogram.width();
+    num_contours = (size - 12) / sizeof(uint16_t) / scan.dimensions[0];
     vector<image<float> *> images(num_contours);
     for (size_t k = 0; k != num_contours; ++k)
     {
       ostringstream os;
       os << "CONTOUR" << k;
       images[k] = &scan.contours[os.str()];
-      *images[k] = image<float>(1, scan.tomogram.width(), scan.tomogram.depth());
+      *images[k] = image<float>(1, scan.dimensions[0], scan.dimensions[2]);
+    }
+
+    // read all slices at once and sort the interleaved contours into images
+    const size_t width = scan.dimensions[0];
+    const size_t stride = 12 + num_contours * width * sizeof(uint16_t);
+    const uint64_t begin = f.pos();
+    vector<char> buf;
+    const char *data;
+    if (f.data() && begin <= f.size() && num_slices * stride <= f.size() - begin)
+      data = f.data() + begin;
+    else
+    {
+      buf.resize(num_slices * stride);
+      if (f.read_at(begin, buf.data(), buf.size()) != buf.size())
+        throw runtime_error("unexpected end of contour data");
+      data = buf.data();
     }
 
-    unique_ptr<uint16_t []> p(new uint16_t[scan.tomogram.width()]);
     for (size_t z = 0; z != num_slices; ++z)
     {
-      f.set(f.pos() + 12);
+      const uint16_t *p = reinterpret_cast<const uint16_t *>(data + z * stride + 12);
       for (size_t k = 0; k != num_contours; ++k)
-      {
-        f.read(p.get(), scan.tomogram.width());
-        copy_n(&p[0], scan.tomogram.width(), images[k]->data() + z * scan.tomogram.width());
-      }
+        widen_contour(p + k * width, images[k]->data() + z * width, width);
     }
   }
 
-  oct_reader r("Nidek OCT", {"x.xml"}, load);
+  /// Nidek scan description: xml with the scan pattern element load requires
+  bool probe(const char *head, size_t size)
+  {
+    const string root = xml::root(head, size);
+    if (root.empty() || root == "uoctml")
+      return false;
+
+    const char tag[] = "<ScanPattern>";
+    return search(head, head + size, tag, tag + strlen(tag)) != head + size;
+  }
+
+  oct_reader r("Nidek OCT", {"x.xml"}, load, probe);
 }
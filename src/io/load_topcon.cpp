@@ -15,14 +15,21 @@
  */
 
 #include <algorithm>
+#include <atomic>
 #include <cstdio>
 #include <cstring>
 #include <iomanip>
 #include <iterator>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
+#include <vector>
 
 #include "../core/oct_data.hpp"
+#include "../core/parallel.hpp"
+#include "../core/slice_cache.hpp"
+#include "../core/view.hpp"
 #include "charconv.hpp"
 #include "file.hpp"
 #include "j2k.hpp"
@@ -34,22 +41,115 @@ using namespace std;
 namespace
 {
 
-  image<uint8_t> read_jp2_image(file &f, size_t channels, size_t width, size_t height)
+  image<uint8_t> read_jp2_image(file &f, size_t channels, size_t width, size_t height, unsigned reduce)
   {
     uint32_t size;
     f.fetch(size);
     unique_ptr<char []> buffer(new char[size]);
     f.read(buffer.get(), size);
 
-    image<uint8_t> img = decode_j2k(buffer.get(), size);
-    if (img.channels() != channels || img.width() != width || img.height() != height)
+    image<uint8_t> img = decode_j2k(buffer.get(), size, 1, reduce);
+    if (img.channels() != channels || img.width() != j2k_reduced_size(width, reduce) || img.height() != j2k_reduced_size(height, reduce))
       throw runtime_error("size mismatch in jpeg2000 image");
 
     return img;
   }
 
-  template <class S_T, class T>
-  void read_raw(file &f, size_t width, size_t height, image<T> &v)
+  /// position of a JPEG2000 image in the file
+  struct jp2_payload
+  {
+    shared_ptr<const file> f;
+    uint64_t offset;
+    uint32_t size;
+    size_t channels, width, height;
+
+    /// decode image from file
+    image<uint8_t> operator()() const
+    {
+      unique_ptr<char []> buffer(new char[size]);
+      if (f->read_at(offset, buffer.get(), size) != size)
+        throw runtime_error("error reading jpeg2000 image");
+
+      image<uint8_t> img = decode_j2k(buffer.get(), size);
+      if (img.channels() != channels || img.width() != width || img.height() != height)
+        throw runtime_error("size mismatch in jpeg2000 image");
+
+      return img;
+    }
+  };
+
+  /// record position of JPEG2000 image and skip it
+  jp2_payload skip_jp2_image(const shared_ptr<file> &f, size_t channels, size_t width, size_t height)
+  {
+    uint32_t size;
+    f->fetch(size);
+    jp2_payload p{f, f->pos(), size, channels, width, height};
+    f->set(f->pos() + size);
+    return p;
+  }
+
+  /// compressed JPEG2000 slices, decoded on demand
+  /**
+   * Concurrent reads decode with decoders of their own.
+   */
+  class j2k_slices
+    : public slice_source
+  {
+    vector<char> m_data;
+    vector<size_t> m_offsets;
+    size_t m_width, m_height;
+    vector<unique_ptr<j2k_decoder>> m_decoders; ///< idle decoders
+    mutex m_mutex;
+
+  public:
+
+    j2k_slices(vector<char> &&data, vector<size_t> &&offsets, size_t width, size_t height)
+      : m_data(move(data)), m_offsets(move(offsets)), m_width(width), m_height(height)
+    {
+    }
+
+    size_t width() const override
+    {
+      return m_width;
+    }
+
+    size_t height() const override
+    {
+      return m_height;
+    }
+
+    size_t depth() const override
+    {
+      return m_offsets.size() - 1;
+    }
+
+    void read(size_t z, size_t x, size_t y, const image_view<uint8_t> &dst) override
+    {
+      if (z >= depth())
+        throw runtime_error("slice index out of range");
+
+      unique_ptr<j2k_decoder> decoder;
+      {
+        lock_guard<mutex> lock(m_mutex);
+        if (!m_decoders.empty())
+        {
+          decoder = move(m_decoders.back());
+          m_decoders.pop_back();
+        }
+      }
+      if (!decoder)
+        decoder.reset(new j2k_decoder());
+
+      const j2k_region region{x, y, dst.width(), dst.height()};
+      decoder->decode(m_data.data() + m_offsets[z], m_offsets[z + 1] - m_offsets[z], dst, 1, &region);
+
+      lock_guard<mutex> lock(m_mutex);
+      m_decoders.push_back(move(decoder));
+    }
+  };
+
+  template <class S_T, class T, class F>
+  void read_raw(file &f, size_t width, size_t height, image<T> &v, F fn)
   {
     unique_ptr<S_T []> d(new S_T[width * height]);
     S_T *p = d.get(), *q = p + width * height;
@@ -57,7 +157,7 @@ namespace
       p += f.read(p, q - p);
 
     v = image<T>(1, width, height);
-    copy_n(d.get(), width * height, v.data());
+    transform(image_view<const S_T>(d.get(), width, height).flip_y(), view(v), fn);
   }
 
   struct date
@@ -81,10 +181,20 @@ namespace
     uint32_t x, y, r, zero;
   };
 
-  void load(const char *path, oct_subject &subject)
+  void load(const char *path, oct_subject &subject, const oct_load_options &options)
   {
     oct_scan &scan = subject.scans[""];
-    file f(path, "rb");
+    // kept open for images decoded later
+    shared_ptr<file> fp = make_shared<file>(path, "rbm");
+    file &f = *fp;
+
+    // images may be decoded at reduced resolution, contours and size refer
+    // to the full resolution tomogram height
+    const bool pixels = options.payload == oct_payload::all;
+    const bool contours = options.payload != oct_payload::metadata;
+    const unsigned reduce = pixels ? options.reduce : 0;
+    const float contour_scale = 1.0f / (1 << reduce);
+    size_t tomogram_height = 0;
 
     char tag[32], s[512], type;
 
@@ -157,22 +267,21 @@ namespace
         f.fetch(size);
         s[20] = 0;
         string cid = latin1_to_utf8(s);
+        if (!contours)
+        {
+          f.set(resume);
+          continue;
+        }
+
+        // flip and invert contours while reading
+        const size_t h = tomogram_height;
         if (size == width * height * 2)
-          ::read_raw<uint16_t>(f, width, height, scan.contours[cid]);
+          ::read_raw<uint16_t>(f, width, height, scan.contours[cid], [h, contour_scale](uint16_t v) { return (h - float(v)) * contour_scale; });
         else if (size == width * height * 8)
-          ::read_raw<double>(f, width, height, scan.contours[cid]);
+          ::read_raw<double>(f, width, height, scan.contours[cid], [h, contour_scale](double v) { return (h - float(v)) * contour_scale; });
         else
           throw runtime_error("unexpected image parameters");
 
-        // flip contours
-        for (size_t y = 0; y != height / 2; ++y)
-          swap_ranges(&scan.contours[cid](0, y), &scan.contours[cid](0, y+1), &scan.contours[cid](0, height - 1 - y));
-
-        // invert contours
-        for (size_t y = 0; y != height; ++y)
-          for (size_t x = 0; x != width; ++x)
-            scan.contours[cid](x, y) = scan.tomogram.height() - scan.contours[cid](x, y);
-
         f.read(s, 32); /* "8.0.1.20198" */
       }
       else if (strcmp(tag, "@EFFECTIVE_SCAN_RANGE") == 0)
@@ -225,13 +334,25 @@ namespace
         if (depth != 1)
           throw runtime_error("unexpected image parameters");
 
-        auto i = ::read_jp2_image(f, bpp / 8, width, height);
+        if (!pixels)
+        {
+          f.set(resume);
+          continue;
+        }
+
+        // color fundus is decoded when asked for
+        const jp2_payload p = ::skip_jp2_image(fp, bpp / 8, width, height);
+        scan.images["color fundus"] = deferred_image([p]() {
+          image<uint8_t> i = p();
 
-        // swap red and blue channels
-        for (size_t y = 0; y != height; ++y)
-          for (size_t x = 0; x != width; ++x)
-            for (size_t c = 0; c != 3; ++c)
-              swap(i(c, x, y), i(2 - c, x, y));
+          // swap red and blue channels
+          if (i.channels() == 3)
+            for (size_t y = 0; y != i.height(); ++y)
+              for (size_t x = 0; x != i.width(); ++x)
+                swap(i(0, x, y), i(2, x, y));
+
+          return i;
+        });
       }
       else if (strcmp(tag, "@IMG_JPEG") == 0)
       {
@@ -251,20 +372,55 @@ namespace
         f.fetch(depth);
         f.read(s, 4); /* 0x00000a02 */
 
-        scan.tomogram = volume<uint8_t>(width, height, depth);
+        scan.dimensions[0] = width;
+        scan.dimensions[1] = height;
+        scan.dimensions[2] = depth;
+        tomogram_height = height;
+        if (!pixels)
+        {
+          f.set(resume);
+          continue;
+        }
+
+        // read all compressed slices, then decode them concurrently
+        vector<char> data;
+        vector<size_t> offsets(1, 0);
         for (size_t z = 0; z != depth; ++z)
         {
           uint32_t size;
           f.fetch(size);
-          unique_ptr<char []> buffer(new char[size]);
-          f.read(buffer.get(), size);
-
-          image<uint8_t> img = decode_j2k(buffer.get(), size);
-          if (img.channels() != 1 || img.width() != width || img.height() != height)
-            throw runtime_error("size mismatch in jpeg2000 image");
+          data.resize(offsets.back() + size);
+          if (f.read(data.data() + offsets.back(), size) != size)
+            throw runtime_error("error reading jpeg2000 image");
+          offsets.push_back(data.size());
+        }
 
-          copy_n(img.data(), width * height, &scan.tomogram(0, 0, z));
+        // out of core or progressive, slices stay compressed and are decoded later
+        if ((options.cache_bytes != 0 || options.progressive) && reduce == 0)
+        {
+          scan.slices = make_shared<j2k_slices>(move(data), move(offsets), width, height);
+          if (options.cache_bytes != 0)
+            scan.slices = make_shared<slice_cache>(scan.slices, options.cache_bytes);
+          f.set(resume);
+          continue;
         }
+
+        // each worker reuses one decoder and takes the next slice when done
+        scan.tomogram = volume<uint8_t>(j2k_reduced_size(width, reduce), j2k_reduced_size(height, reduce), depth);
+        const size_t workers = min<size_t>(concurrency(), depth), threads = max<size_t>(1, concurrency() / max<size_t>(depth, 1));
+        atomic<size_t> next(0);
+        task_group tasks(workers);
+        for (size_t i = 0; i != workers; ++i)
+          tasks.run([&]() {
+            j2k_decoder decoder(threads, reduce);
+            for (size_t z; (z = next++) < depth; )
+              decoder.decode(data.data() + offsets[z], offsets[z + 1] - offsets[z], view(scan.tomogram).slice(z));
+          });
+        tasks.wait();
+
+        // keep compressed slices of reduced tomograms to show details
+        if (reduce != 0)
+          scan.slices = make_shared<j2k_slices>(move(data), move(offsets), width, height);
       }
       else if (strcmp(tag, "@IMG_MOT_COMP_03") == 0)
       {
@@ -287,7 +443,13 @@ namespace
         f.fetch(height);
         f.fetch(bpp); /* 0x00000008 */
         f.read(s, 4); /* 0x01000002 */
-        ::read_jp2_image(f, bpp / 8, width, height);
+        if (!pixels)
+        {
+          f.set(resume);
+          continue;
+        }
+
+        scan.images["projection"] = deferred_image(::skip_jp2_image(fp, bpp / 8, width, height));
       }
       else if (strcmp(tag, "@IMG_TRC_02") == 0)
       {
@@ -296,8 +458,21 @@ namespace
         f.fetch(bpp); /* 0x00000018 */
         f.fetch(depth); /* 0x00000002 */
         f.read(s, 1); /* 0x01 */
-        for (size_t i = 0; i != depth; ++i)
-          scan.fundus = ::read_jp2_image(f, bpp / 8, width, height);
+        if (!pixels)
+        {
+          f.set(resume);
+          continue;
+        }
+
+        // the last image is the fundus, earlier ones are decoded when asked for
+        for (size_t i = 0; i + 1 < depth; ++i)
+        {
+          ostringstream o;
+          o << "trc " << i;
+          scan.images[o.str()] = deferred_image(::skip_jp2_image(fp, bpp / 8, width, height));
+        }
+        if (depth != 0)
+          scan.fundus = ::read_jp2_image(f, bpp / 8, width, height, reduce);
       }
       else if (strcmp(tag, "@MAIN_MODULE_INFO") == 0)
       {
@@ -431,8 +606,20 @@ namespace
       f.set(resume);
     }
 
-    scan.size[1] *= scan.tomogram.height() / 1000.0f;
+    scan.size[1] *= tomogram_height / 1000.0f;
+
+    // fundus range in reduced pixel coordinates
+    scan.range.minx >>= reduce;
+    scan.range.maxx >>= reduce;
+    scan.range.miny >>= reduce;
+    scan.range.maxy >>= reduce;
+    scan.reduced = reduce;
+  }
+
+  bool probe(const char *head, size_t size)
+  {
+    return size >= 7 && strncmp(head, "FOCT", 4) == 0 && (strncmp(head + 4, "FDA", 3) == 0 || strncmp(head + 4, "FAA", 3) == 0);
   }
 
-  oct_reader r("Topcon OCT", {".fda"}, load);
+  oct_reader r("Topcon OCT", {".fda"}, load, probe);
 }
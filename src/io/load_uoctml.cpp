@@ -15,9 +15,20 @@
  */
 
 #include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <stdexcept>
+#include <vector>
+
+#include <qDebug>
+
+#include <zlib.h>
 
 #include "../core/oct_data.hpp"
+#include "../core/parallel.hpp"
+#include "../core/slice_cache.hpp"
+#include "../core/view.hpp"
 #include "file.hpp"
 #include "xml.hpp"
 
@@ -26,175 +37,318 @@ using namespace std;
 namespace
 {
 
-  struct parse
+  /// raw 8 bit slices in a data file, read when needed
+  class raw_slices
+    : public slice_source
   {
-    oct_subject &subject;
-    const string dirname;
-    string cur, scan_id, key, value, cname, path;
-    map<string, string> info, *cur_info;
-    bounding_box scan_range;
-    float scan_size[3];
+    shared_ptr<const file> m_file;
+    uint64_t m_offset;
+    size_t m_width, m_height, m_depth;
+
+  public:
+
+    raw_slices(const shared_ptr<const file> &f, uint64_t offset, size_t width, size_t height, size_t depth)
+      : m_file(f), m_offset(offset), m_width(width), m_height(height), m_depth(depth)
+    {
+    }
+
+    size_t width() const override
+    {
+      return m_width;
+    }
+
+    size_t height() const override
+    {
+      return m_height;
+    }
+
+    size_t depth() const override
+    {
+      return m_depth;
+    }
+
+    void read(size_t z, size_t x, size_t y, const image_view<uint8_t> &dst) override
+    {
+      if (z >= m_depth || x > m_width || dst.width() > m_width - x || y > m_height || dst.height() > m_height - y)
+        throw runtime_error("slice region out of range");
+
+      vector<uint8_t> row(dst.width());
+      for (size_t v = 0; v != dst.height(); ++v)
+      {
+        if (m_file->read_at(m_offset + (uint64_t(z) * m_height + y + v) * m_width + x, row.data(), row.size()) != row.size())
+          throw runtime_error("error reading tomogram data");
+
+        copy(image_view<const uint8_t>(row.data(), row.size(), 1), dst.sub(0, v, dst.width(), 1));
+      }
+    }
+  };
+
+  /// independently deflated 8 bit slices followed by an index of their offsets
+  /**
+   * Storage "zlib-slices" of UOCTML 2.0. The index holds depth + 1 offsets
+   * of the slices relative to the start of the data, the last one is the end
+   * of the last slice. Slices may be inflated concurrently.
+   */
+  class zlib_slices
+    : public slice_source
+  {
+    shared_ptr<const file> m_file;
+    uint64_t m_offset;
+    size_t m_width, m_height;
+    vector<uint64_t> m_index;
+
+  public:
+
+    zlib_slices(const shared_ptr<const file> &f, uint64_t offset, uint64_t size, size_t width, size_t height, size_t depth)
+      : m_file(f), m_offset(offset), m_width(width), m_height(height), m_index(depth + 1)
+    {
+      const uint64_t index_size = m_index.size() * sizeof(uint64_t);
+      if (size < index_size || m_file->read_at(offset + size - index_size, m_index.data(), index_size) != index_size)
+        throw runtime_error("error reading slice index");
+
+      for (size_t z = 0; z != depth; ++z)
+        if (m_index[z] > m_index[z + 1])
+          throw runtime_error("broken slice index");
+      if (m_index[0] != 0 || m_index[depth] > size - index_size)
+        throw runtime_error("broken slice index");
+    }
+
+    size_t width() const override
+    {
+      return m_width;
+    }
+
+    size_t height() const override
+    {
+      return m_height;
+    }
+
+    size_t depth() const override
+    {
+      return m_index.size() - 1;
+    }
+
+    void read(size_t z, size_t x, size_t y, const image_view<uint8_t> &dst) override
+    {
+      if (z >= depth() || x > m_width || dst.width() > m_width - x || y > m_height || dst.height() > m_height - y)
+        throw runtime_error("slice region out of range");
+
+      // compressed slice, from the mapping if possible
+      const size_t n = m_index[z + 1] - m_index[z];
+      const uint64_t pos = m_offset + m_index[z];
+      vector<char> chunk;
+      const char *src = m_file->data();
+      if (src && pos <= m_file->size() && n <= m_file->size() - pos)
+        src += pos;
+      else
+      {
+        chunk.resize(n);
+        if (m_file->read_at(pos, chunk.data(), n) != n)
+          throw runtime_error("error reading tomogram data");
+        src = chunk.data();
+      }
+
+      // whole slices into contiguous memory are inflated in place
+      const bool direct = x == 0 && y == 0 && dst.width() == m_width && dst.height() == m_height && dst.xstride() == 1 && dst.ystride() == ptrdiff_t(m_width);
+      vector<uint8_t> slice(direct ? 0 : m_width * m_height);
+      uint8_t *out = direct ? &dst(0, 0) : slice.data();
+      uLongf size = m_width * m_height;
+      if (uncompress(out, &size, reinterpret_cast<const Bytef *>(src), n) != Z_OK || size != m_width * m_height)
+        throw runtime_error("error inflating slice");
+
+      if (!direct)
+        copy(image_view<const uint8_t>(slice.data(), m_width, m_height).sub(x, y, dst.width(), dst.height()), dst);
+    }
+  };
+
+  /// data of an image in a data file
+  struct blob
+  {
+    string path;
+    uint64_t pos, size;
+    string storage;
+  };
+
+  /// contour dimensions and data
+  struct contour_desc
+  {
+    size_t width, height;
+    blob data;
+  };
+
+  /// a scan as described in the xml file, data is read afterwards
+  struct scan_desc
+  {
+    string id;
+    map<string, string> info;
+    bounding_box range;
+    float size[3];
     size_t fundus_channels, fundus_width, fundus_height;
+    blob fundus;
     size_t tomogram_width, tomogram_height, tomogram_depth;
+    blob tomogram;
+    map<string, contour_desc> contours;
+  };
+
+  struct parse
+  {
+    oct_subject &subject;
+    const oct_load_options &options;
+    string cur, key, value, cname;
+    map<string, string> *cur_info;
+    scan_desc scan;
+    blob cur_data;
     size_t contour_width, contour_height;
-    size_t pos, length;
-    pair<string, size_t> fundus_pos, tomogram_pos;
-    map<string, tuple<string, size_t, size_t, size_t>> contour_pos;
+    vector<scan_desc> scans; ///< selected scans
 
-    parse(oct_subject &subject, const string &dirname)
-      : subject(subject), dirname(dirname), cur_info(&subject.info)
+    parse(oct_subject &subject, const oct_load_options &options)
+      : subject(subject), options(options), cur_info(&subject.info)
     {
     }
 
-    const char *find(const char **attr, const string &key)
+    const char *find(const char **attr, const char *key)
     {
-      while (*attr && key != *attr)
+      while (*attr && strcmp(*attr, key) != 0)
         attr += 2;
 
       if (!*attr)
-        throw runtime_error("missing attribute \"" + key + "\"");
+        throw runtime_error(string("missing attribute \"") + key + "\"");
 
       return attr[1];
     }
 
-    void start(const string &name, const char **attr)
+    void start(const xml_name &name, const char **attr)
     {
       cur.clear();
       try
       {
-        if (name == "uoctml")
-        {
-          if (find(attr, "version") != string("1.0"))
-            throw runtime_error("unsupported version");
-        }
-        else if (name == "scan")
-        {
-          cur_info = &info;
-        }
-        else if (name == "fundus")
+        switch (name.hash())
         {
-          fundus_channels = atoi(find(attr, "channels"));
-          fundus_width = atoi(find(attr, "width"));
-          fundus_height = atoi(find(attr, "height"));
-          if (find(attr, "type") != string("u8"))
+        case xml_tag("uoctml"):
+          {
+            const string version = find(attr, "version");
+            if (version != "1.0" && version != "2.0")
+              throw runtime_error("unsupported version");
+          }
+          break;
+        case xml_tag("scan"):
+          scan = scan_desc();
+          cur_info = &scan.info;
+          break;
+        case xml_tag("fundus"):
+          scan.fundus_channels = atoi(find(attr, "channels"));
+          scan.fundus_width = atoi(find(attr, "width"));
+          scan.fundus_height = atoi(find(attr, "height"));
+          if (strcmp(find(attr, "type"), "u8") != 0)
             throw runtime_error("unknown type");
-        }
-        else if (name == "range")
-        {
-          scan_range.minx = atoi(find(attr, "minx"));
-          scan_range.miny = atoi(find(attr, "miny"));
-          scan_range.maxx = atoi(find(attr, "maxx"));
-          scan_range.maxy = atoi(find(attr, "maxy"));
-        }
-        else if (name == "size")
-        {
-          scan_size[0] = atof(find(attr, "x"));
-          scan_size[1] = atof(find(attr, "y"));
-          scan_size[2] = atof(find(attr, "z"));
-        }
-        else if (name == "tomogram")
-        {
-          tomogram_width = atoi(find(attr, "width"));
-          tomogram_height = atoi(find(attr, "height"));
-          tomogram_depth = atoi(find(attr, "depth"));
-          if (find(attr, "type") != string("u8"))
+          break;
+        case xml_tag("range"):
+          scan.range.minx = atoi(find(attr, "minx"));
+          scan.range.miny = atoi(find(attr, "miny"));
+          scan.range.maxx = atoi(find(attr, "maxx"));
+          scan.range.maxy = atoi(find(attr, "maxy"));
+          break;
+        case xml_tag("size"):
+          scan.size[0] = atof(find(attr, "x"));
+          scan.size[1] = atof(find(attr, "y"));
+          scan.size[2] = atof(find(attr, "z"));
+          break;
+        case xml_tag("tomogram"):
+          scan.tomogram_width = atoi(find(attr, "width"));
+          scan.tomogram_height = atoi(find(attr, "height"));
+          scan.tomogram_depth = atoi(find(attr, "depth"));
+          if (strcmp(find(attr, "type"), "u8") != 0)
             throw runtime_error("unknown type");
-        }
-        else if (name == "contour")
-        {
+          break;
+        case xml_tag("contour"):
           contour_width = atoi(find(attr, "width"));
           contour_height = atoi(find(attr, "height"));
-          if (find(attr, "type") != string("f32"))
+          if (strcmp(find(attr, "type"), "f32") != 0)
             throw runtime_error("unknown type");
-        }
-        else if (name == "data")
-        {
-          pos = atoi(find(attr, "start"));
-          length = atoi(find(attr, "size"));
-          if (find(attr, "storage") != string("raw"))
+          break;
+        case xml_tag("data"):
+          // 64 bit offsets, data files may exceed 2 GiB
+          cur_data.pos = strtoull(find(attr, "start"), 0, 10);
+          cur_data.size = strtoull(find(attr, "size"), 0, 10);
+          cur_data.storage = find(attr, "storage");
+          if (cur_data.storage != "raw" && cur_data.storage != "zlib-slices")
             throw runtime_error("unknown storage");
-        }
-        else if (name != "info" && name != "key" && name != "value" && name != "id" && name != "name")
+          break;
+        case xml_tag("info"):
+        case xml_tag("key"):
+        case xml_tag("value"):
+        case xml_tag("id"):
+        case xml_tag("name"):
+          break;
+        default:
           throw runtime_error("unknown tag");
+        }
       }
       catch (exception &e)
       {
-        throw runtime_error("tag \"" + name + "\": " + e.what());
+        throw runtime_error(string("tag \"") + name.c_str() + "\": " + e.what());
       }
     }
 
-    void end(const string &name)
+    void end(const xml_name &name)
     {
       try
       {
-        if (name == "id")
-          scan_id = cur;
-        else if (name == "key")
+        switch (name.hash())
+        {
+        case xml_tag("id"):
+          scan.id = cur;
+          break;
+        case xml_tag("key"):
           key = cur;
-        else if (name == "value")
+          break;
+        case xml_tag("value"):
           value = cur;
-        else if (name == "info")
+          break;
+        case xml_tag("info"):
           cur_info->insert(make_pair(key, value));
-        else if (name == "data")
-          path = cur;
-        else if (name == "name")
+          break;
+        case xml_tag("data"):
+          cur_data.path = cur;
+          break;
+        case xml_tag("name"):
           cname = cur;
-        else if (name == "fundus")
-        {
-          fundus_pos = make_pair(path, pos);
-          if (length != fundus_channels * fundus_width * fundus_height)
+          break;
+        case xml_tag("fundus"):
+          scan.fundus = cur_data;
+          if (cur_data.storage != "raw")
+            throw runtime_error("unsupported storage");
+          if (cur_data.size != scan.fundus_channels * scan.fundus_width * scan.fundus_height)
             throw runtime_error("fundus data size mismatch");
-        }
-        else if (name == "tomogram")
-        {
-          tomogram_pos = make_pair(path, pos);
-          if (length != tomogram_width * tomogram_height * tomogram_depth)
+          break;
+        case xml_tag("tomogram"):
+          scan.tomogram = cur_data;
+          if (cur_data.storage == "raw" && cur_data.size != scan.tomogram_width * scan.tomogram_height * scan.tomogram_depth)
             throw runtime_error("tomogram data size mismatch");
-        }
-        else if (name == "contour")
-        {
-          contour_pos[cname] = make_tuple(path, contour_width, contour_height, pos);
-          if (length != 4 * contour_width * contour_height)
+          break;
+        case xml_tag("contour"):
+          scan.contours[cname] = contour_desc{contour_width, contour_height, cur_data};
+          if (cur_data.storage != "raw")
+            throw runtime_error("unsupported storage");
+          if (cur_data.size != 4 * contour_width * contour_height)
             throw runtime_error("contour data size mismatch");
-        }
-        else if (name == "scan")
-        {
+          break;
+        case xml_tag("scan"):
           cur_info = &subject.info;
-
-          oct_scan &scan = subject.scans[scan_id];
-          scan.info = info;
-          info.clear();
-
-          scan.range = scan_range;
-          copy_n(scan_size, 3, scan.size);
-          {
-            scan.fundus = image<uint8_t>(fundus_channels, fundus_width, fundus_height);
-            file f((dirname + fundus_pos.first).c_str(), "rb");
-            f.set(fundus_pos.second);
-            f.read(scan.fundus.data(), fundus_channels * fundus_width * fundus_height);
-          }
-          {
-            scan.tomogram = volume<uint8_t>(tomogram_width, tomogram_height, tomogram_depth);
-            file f((dirname + tomogram_pos.first).c_str(), "rb");
-            f.set(tomogram_pos.second);
-            f.read(scan.tomogram.data(), tomogram_width * tomogram_height * tomogram_depth);
-          }
-          for (const auto &c: contour_pos)
-          {
-            scan.contours[c.first] = image<float>(1, get<1>(c.second), get<2>(c.second));
-            file f((dirname + get<0>(c.second)).c_str(), "rb");
-            f.set(get<3>(c.second));
-            f.read(scan.contours[c.first].data(), get<1>(c.second) * get<2>(c.second));
-          }
-
-          contour_pos.clear();
-        }
-        else if (name != "uoctml" && name != "range" && name != "size" && name != "data")
+          if (options.scans.empty() || options.scans.count(scan.id))
+            scans.push_back(move(scan));
+          break;
+        case xml_tag("uoctml"):
+        case xml_tag("range"):
+        case xml_tag("size"):
+          break;
+        default:
           throw runtime_error("unknown tag");
+        }
       }
       catch (exception &e)
       {
-        throw runtime_error("tag \"" + name + "\": " + e.what());
+        throw runtime_error(string("tag \"") + name.c_str() + "\": " + e.what());
       }
     }
 
@@ -205,30 +359,181 @@ namespace
 
   };
 
-  void load(const char *path, oct_subject &subject)
+  /// positional read into preallocated memory
+  struct read_job
   {
+    const file *f;
+    uint64_t pos;
+    char *dst;
+    size_t size;
+  };
+
+  /// largest single read, so large blobs are read concurrently too
+  const size_t max_read_size = size_t(16) << 20;
+
+  /// data files, each opened and mapped once
+  class data_files
+  {
+    const string m_dirname;
+    map<string, shared_ptr<file>> m_files;
+
+  public:
+
+    vector<read_job> jobs; ///< reads for data that cannot be mapped
+    size_t mapped; ///< blobs used mapped
+
+    explicit data_files(const string &dirname)
+      : m_dirname(dirname), mapped(0)
+    {
+    }
+
+    shared_ptr<file> open(const string &name)
+    {
+      shared_ptr<file> &f = m_files[name];
+      if (!f)
+        f = make_shared<file>((m_dirname + name).c_str(), "rbm");
+
+      return f;
+    }
+
+    size_t size() const
+    {
+      return m_files.size();
+    }
+
+    /// storage of n values of a blob, mapped or to be read by the jobs
+    template <class T>
+    storage<T> place(const blob &b, size_t n)
+    {
+      if (n == 0)
+        return storage<T>();
+
+      shared_ptr<file> f = open(b.path);
+      storage<T> s = mapped_storage<T>(f, b.pos, n);
+      if (s.data())
+      {
+        ++mapped;
+        return s;
+      }
+
+      s = storage<T>(n);
+      char *dst = reinterpret_cast<char *>(s.data());
+      for (size_t i = 0; i < n * sizeof(T); i += max_read_size)
+        jobs.push_back(read_job{f.get(), b.pos + i, dst + i, min(max_read_size, n * sizeof(T) - i)});
+      return s;
+    }
+  };
+
+  void load(const char *path, oct_subject &subject, const oct_load_options &options)
+  {
+    const auto start_time = chrono::steady_clock::now();
+
     size_t lastsep = string(path).rfind('/')+1;
     #ifdef _WIN32
     lastsep = max(lastsep, string(path).rfind('\\')+1);
     #endif
     string dirname(path, 0, lastsep);
 
-    parse p(subject, dirname);
+    // parse the whole description first, from the mapping if possible
+    parse p(subject, options);
+    size_t xml_reads = 0;
     {
-      using placeholders::_1;
-      using placeholders::_2;
-      file f(path, "rb");
-      string cur;
-      xml x(bind(&parse::start, ref(p), _1, _2), bind(&parse::end, ref(p), _1), bind(&parse::data, ref(p), _1, _2));
-      char buf[1024];
-      while (f)
+      file f(path, "rbm");
+      xml_parser<parse> x(p);
+      if (f.data())
       {
-        size_t r = f.read(buf, sizeof(buf));
-        x(buf, r, r == 0);
+        // expat takes int sizes
+        const size_t piece = size_t(1) << 30;
+        for (size_t i = 0; i < f.size(); i += piece)
+          x(f.data() + i, min(piece, f.size() - i), false);
+        x(f.data(), 0, true);
+      }
+      else
+      {
+        vector<char> buf(size_t(1) << 20);
+        while (f)
+        {
+          size_t r = f.read(buf.data(), buf.size());
+          ++xml_reads;
+          x(buf.data(), r, r == 0);
+        }
       }
     }
+
+    // place all images, then read what is not mapped at once
+    data_files files(dirname);
+    vector<pair<oct_scan *, const scan_desc *>> compressed;
+    for (const scan_desc &d: p.scans)
+    {
+      oct_scan &scan = subject.scans[d.id];
+      scan.info = d.info;
+      scan.range = d.range;
+      copy_n(d.size, 3, scan.size);
+      scan.dimensions[0] = d.tomogram_width;
+      scan.dimensions[1] = d.tomogram_height;
+      scan.dimensions[2] = d.tomogram_depth;
+      if (options.payload == oct_payload::metadata)
+        continue;
+
+      if (options.payload == oct_payload::all)
+      {
+        scan.fundus = image<uint8_t>(d.fundus_channels, d.fundus_width, d.fundus_height,
+                                     files.place<uint8_t>(d.fundus, d.fundus_channels * d.fundus_width * d.fundus_height));
+
+        if (d.tomogram.storage == "zlib-slices")
+          compressed.push_back(make_pair(&scan, &d));
+        else if (options.cache_bytes != 0)
+        {
+          // out of core, slices are read when shown
+          auto source = make_shared<raw_slices>(files.open(d.tomogram.path), d.tomogram.pos, d.tomogram_width, d.tomogram_height, d.tomogram_depth);
+          scan.slices = make_shared<slice_cache>(source, options.cache_bytes);
+        }
+        else
+          scan.tomogram = volume<uint8_t>(d.tomogram_width, d.tomogram_height, d.tomogram_depth,
+                                          files.place<uint8_t>(d.tomogram, d.tomogram_width * d.tomogram_height * d.tomogram_depth));
+      }
+
+      for (const auto &c: d.contours)
+        scan.contours[c.first] = image<float>(1, c.second.width, c.second.height, files.place<float>(c.second.data, c.second.width * c.second.height));
+    }
+
+    uint64_t bytes_read = 0;
+    for (const read_job &j: files.jobs)
+      bytes_read += j.size;
+    parallel_for(0, files.jobs.size(), [&](size_t i) {
+      const read_job &j = files.jobs[i];
+      if (j.f->read_at(j.pos, j.dst, j.size) != j.size)
+        throw runtime_error("error reading data file");
+    });
+
+    // compressed tomograms, slices are inflated when needed or all at once on all cores
+    for (const auto &c: compressed)
+    {
+      oct_scan &scan = *c.first;
+      const scan_desc &d = *c.second;
+      auto source = make_shared<zlib_slices>(files.open(d.tomogram.path), d.tomogram.pos, d.tomogram.size, d.tomogram_width, d.tomogram_height, d.tomogram_depth);
+      if (options.cache_bytes != 0)
+        scan.slices = make_shared<slice_cache>(source, options.cache_bytes);
+      else if (options.progressive)
+        scan.slices = source;
+      else
+      {
+        scan.tomogram = volume<uint8_t>(d.tomogram_width, d.tomogram_height, d.tomogram_depth);
+        const volume_view<uint8_t> dst = view(scan.tomogram);
+        parallel_for(0, d.tomogram_depth, [&](size_t z) { source->read(z, 0, 0, dst.slice(z)); });
+      }
+    }
+
+    qDebug() << "uoctml:" << p.scans.size() << "scans from" << files.size() << "data files," << xml_reads << "xml reads,"
+             << files.mapped << "blobs mapped," << files.jobs.size() << "reads," << bytes_read / (1 << 20) << "MiB in"
+             << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time).count() << "ms";
+  }
+
+  bool probe(const char *head, size_t size)
+  {
+    return xml::root(head, size) == "uoctml";
   }
 
-  oct_reader r("UOCTML", {".uoctml"}, load);
+  oct_reader r("UOCTML", {".uoctml"}, load, probe);
 
 }
@@ -18,27 +18,67 @@
 #include "save_uoctml.hpp"
 
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
 #include <fstream>
 #include <stdexcept>
 #include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "../core/parallel.hpp"
 
 using namespace std;
 
 namespace
 {
 
+  /// output file, written to a temporary and renamed over the target by commit()
+  /**
+   * The target may be mapped by the loaded subject being saved, see
+   * mapped_storage(). Truncating it in place would pull the pages away under
+   * the mapping, while replacing it leaves the old contents intact for as long
+   * as they are mapped.
+   */
   struct file
   {
+    const string path, tmp;
     ofstream m;
-    file(const string &path, ios_base::openmode mode = ios_base::out) : m(path, mode)
+    file(const string &path, ios_base::openmode mode = ios_base::out) : path(path), tmp(path + ".tmp"), m(tmp, mode)
     {
       if (!m)
         throw runtime_error(path + string(": error opening file"));
     }
 
    ~file()
+    {
+      if (m.is_open())
+      {
+        m.close();
+        remove(tmp.c_str());
+      }
+    }
+
+    void commit()
     {
       m.close();
+      if (!m)
+        throw runtime_error(path + string(": error writing file"));
+
+#ifdef _WIN32
+      if (!MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+#else
+      if (rename(tmp.c_str(), path.c_str()) != 0)
+#endif
+      {
+        remove(tmp.c_str());
+        throw runtime_error(path + string(": error replacing file"));
+      }
     }
 
     template <class T>
@@ -50,9 +90,21 @@ namespace
 
   };
 
+  /// deflate one slice
+  vector<char> compress_slice(const uint8_t *data, size_t n)
+  {
+    uLongf size = compressBound(n);
+    vector<char> chunk(size);
+    if (compress2(reinterpret_cast<Bytef *>(chunk.data()), &size, data, n, Z_DEFAULT_COMPRESSION) != Z_OK)
+      throw runtime_error("error compressing slice");
+
+    chunk.resize(size);
+    return chunk;
+  }
+
 }
 
-void save_uoctml(const char *path, const oct_subject &subject, bool anonymize)
+void save_uoctml(const char *path, const oct_subject &subject, bool anonymize, bool compress)
 {
   size_t lastsep = string(path).rfind('/')+1;
   #ifdef _WIN32
@@ -64,7 +116,7 @@ void save_uoctml(const char *path, const oct_subject &subject, bool anonymize)
   file bin(path + string(".bin"), ios_base::binary);
 
   o << "<?xml version=\"1.0\" encoding=\"utf-8\" standalone=\"yes\"?>\n";
-  o << "<uoctml version=\"1.0\">\n";
+  o << "<uoctml version=\"" << (compress ? "2.0" : "1.0") << "\">\n";
   for (const auto &e: subject.info)
     if (!anonymize || e.first != "name")
       o << "  <info><key>" << e.first << "</key><value>" << e.second << "</value></info>\n";
@@ -100,9 +152,12 @@ void save_uoctml(const char *path, const oct_subject &subject, bool anonymize)
       << "\" maxx=\"" << scan.second.range.maxx
       << "\" maxy=\"" << scan.second.range.maxy << "\"/>\n";
 
-    const size_t sw = scan.second.tomogram.width();
-    const size_t sh = scan.second.tomogram.height();
-    const size_t sd = scan.second.tomogram.depth();
+    // tomograms kept out of core are written slice by slice
+    const shared_ptr<slice_source> &slices = scan.second.slices;
+    const bool out_of_core = !scan.second.tomogram.data() && slices;
+    const size_t sw = out_of_core ? slices->width() : scan.second.tomogram.width();
+    const size_t sh = out_of_core ? slices->height() : scan.second.tomogram.height();
+    const size_t sd = out_of_core ? slices->depth() : scan.second.tomogram.depth();
 
     o << "    <size x=\"" << scan.second.size[0]
       << "\" y=\"" << scan.second.size[1]
@@ -110,11 +165,49 @@ void save_uoctml(const char *path, const oct_subject &subject, bool anonymize)
 
     o << "    <tomogram width=\"" << sw << "\" height=\"" << sh
       << "\" depth=\"" << sd << "\" type=\"u8\">\n";
-    o << "      <data storage=\"raw\" start=\"" << bin.m.tellp()
-      << "\" size=\"" << sw * sh * sd << "\">" << base << ".bin</data>\n";
-    o << "    </tomogram>\n";
 
-    bin.m.write(reinterpret_cast<const char *>(scan.second.tomogram.data()), sw * sh * sd);
+    if (compress)
+    {
+      // independently deflated slices, followed by their offsets
+      vector<vector<char>> chunks(sd);
+      parallel_for(0, sd, [&](size_t z) {
+        if (!out_of_core)
+          chunks[z] = compress_slice(scan.second.tomogram.data() + z * sw * sh, sw * sh);
+        else
+        {
+          image<uint8_t> slice(1, sw, sh);
+          slices->read(z, 0, 0, view(slice));
+          chunks[z] = compress_slice(slice.data(), sw * sh);
+        }
+      });
+
+      vector<uint64_t> index(1, 0);
+      for (const auto &c: chunks)
+        index.push_back(index.back() + c.size());
+
+      o << "      <data storage=\"zlib-slices\" start=\"" << bin.m.tellp()
+        << "\" size=\"" << index.back() + index.size() * sizeof(uint64_t) << "\">" << base << ".bin</data>\n";
+      for (const auto &c: chunks)
+        bin.m.write(c.data(), c.size());
+      bin.m.write(reinterpret_cast<const char *>(index.data()), index.size() * sizeof(uint64_t));
+    }
+    else
+    {
+      o << "      <data storage=\"raw\" start=\"" << bin.m.tellp()
+        << "\" size=\"" << sw * sh * sd << "\">" << base << ".bin</data>\n";
+      if (out_of_core)
+      {
+        image<uint8_t> slice(1, sw, sh);
+        for (size_t z = 0; z != sd; ++z)
+        {
+          slices->read(z, 0, 0, view(slice));
+          bin.m.write(reinterpret_cast<const char *>(slice.data()), sw * sh);
+        }
+      }
+      else
+        bin.m.write(reinterpret_cast<const char *>(scan.second.tomogram.data()), sw * sh * sd);
+    }
+    o << "    </tomogram>\n";
 
     for (const auto &c: scan.second.contours)
     {
@@ -134,4 +227,8 @@ void save_uoctml(const char *path, const oct_subject &subject, bool anonymize)
   }
 
   o << "</uoctml>\n";
+
+  // data first, so the description never refers to missing data
+  bin.commit();
+  o.commit();
 }
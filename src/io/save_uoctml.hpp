@@ -20,6 +20,10 @@
 #include "../core/oct_data.hpp"
 
 /// save as uoctml
-void save_uoctml(const char *path, const oct_subject &subject, bool anonymize);
+/**
+ * With compress, tomogram slices are deflated one by one and the file is
+ * written as UOCTML 2.0, see load_uoctml.cpp.
+ */
+void save_uoctml(const char *path, const oct_subject &subject, bool anonymize, bool compress = false);
 
 #endif // inclusion guard
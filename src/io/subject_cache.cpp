@@ -0,0 +1,661 @@
+/*
+ * Copyright 2015 TU Chemnitz
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "subject_cache.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include <qDebug>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <sys/stat.h>
+#include <sys/utime.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <utime.h>
+#endif
+
+#include "../core/parallel.hpp"
+#include "../core/progressive.hpp"
+#include "file.hpp"
+
+using namespace std;
+
+namespace
+{
+
+  typedef subject_cache::source_id source_id;
+
+  const char cache_magic[8] = {'O', 'C', 'T', 'C', 'A', 'C', 'H', 'E'};
+
+  /// increase whenever readers decode differently
+  const uint32_t cache_version = 3;
+
+  /// alignment of image data in cache files, so it can be used mapped
+  const size_t blob_alignment = 64;
+
+  /// pieces of source files hashed concurrently
+  const size_t hash_chunk_bytes = size_t(4) << 20;
+
+  uint64_t fnv1a(uint64_t h, const void *data, size_t n)
+  {
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i != n; ++i)
+      h = (h ^ p[i]) * 0x100000001b3ull;
+    return h;
+  }
+
+  const uint64_t prime1 = 0x9e3779b185ebca87ull, prime2 = 0xc2b2ae3d27d4eb4full, prime3 = 0x165667b19e3779f9ull,
+    prime4 = 0x85ebca77c2b2ae63ull, prime5 = 0x27d4eb2f165667c5ull;
+
+  uint64_t rotl(uint64_t x, int r)
+  {
+    return (x << r) | (x >> (64 - r));
+  }
+
+  uint64_t load64(const char *p)
+  {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  uint64_t mix(uint64_t acc, uint64_t v)
+  {
+    return rotl(acc + v * prime2, 31) * prime1;
+  }
+
+  /// fast 64 bit hash of n bytes, after xxHash64
+  uint64_t content_hash(const char *p, size_t n, uint64_t seed)
+  {
+    uint64_t v[4] = {seed + prime1 + prime2, seed + prime2, seed, seed - prime1};
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+      for (size_t k = 0; k != 4; ++k)
+        v[k] = mix(v[k], load64(p + i + 8 * k));
+
+    uint64_t h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+    for (size_t k = 0; k != 4; ++k)
+      h = (h ^ mix(0, v[k])) * prime1 + prime4;
+    h += n;
+
+    for (; i + 8 <= n; i += 8)
+      h = rotl(h ^ mix(0, load64(p + i)), 27) * prime1 + prime4;
+    for (; i != n; ++i)
+      h = rotl(h ^ (static_cast<unsigned char>(p[i]) * prime5), 11) * prime1;
+
+    h ^= h >> 33;
+    h *= prime2;
+    h ^= h >> 29;
+    h *= prime3;
+    h ^= h >> 32;
+    return h;
+  }
+
+  uint64_t file_size(const char *path)
+  {
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_stat64(path, &st) != 0)
+#else
+    struct stat st;
+    if (stat(path, &st) != 0)
+#endif
+      throw runtime_error(string("could not open \"") + path + "\"");
+    return st.st_size;
+  }
+
+  /// cache file being written
+  class writer
+  {
+    FILE *m;
+    uint64_t m_pos;
+
+  public:
+
+    explicit writer(const string &path)
+      : m(fopen(path.c_str(), "wb")), m_pos(0)
+    {
+      if (!m)
+        throw runtime_error(path + ": error opening file");
+    }
+
+   ~writer()
+    {
+      if (m)
+        fclose(m);
+    }
+
+    void write(const void *data, size_t n)
+    {
+      if (n != 0 && fwrite(data, 1, n, m) != n)
+        throw runtime_error("error writing cache file");
+      m_pos += n;
+    }
+
+    template <class T>
+    void put(const T &v)
+    {
+      write(&v, sizeof(T));
+    }
+
+    void put_string(const string &s)
+    {
+      put(uint64_t(s.size()));
+      write(s.data(), s.size());
+    }
+
+    void put_map(const map<string, string> &m)
+    {
+      put(uint64_t(m.size()));
+      for (const auto &e: m)
+      {
+        put_string(e.first);
+        put_string(e.second);
+      }
+    }
+
+    /// write aligned data
+    void blob(const void *data, size_t n)
+    {
+      static const char zero[blob_alignment] = {};
+      write(zero, (blob_alignment - m_pos % blob_alignment) % blob_alignment);
+      write(data, n);
+    }
+
+    template <class T>
+    void put_image(const image<T> &img)
+    {
+      put(uint64_t(img.channels()));
+      put(uint64_t(img.width()));
+      put(uint64_t(img.height()));
+      blob(img.data(), img.channels() * img.width() * img.height() * sizeof(T));
+    }
+
+    void close()
+    {
+      FILE *f = m;
+      m = 0;
+      if (fclose(f) != 0)
+        throw runtime_error("error writing cache file");
+    }
+  };
+
+  /// cache file being read
+  class reader
+  {
+    shared_ptr<file> m_file;
+    file_cursor m_cur;
+    uint64_t m_size;
+
+  public:
+
+    explicit reader(const string &path)
+      : m_file(make_shared<file>(path.c_str(), "rbm")), m_cur(*m_file), m_size(file_size(path.c_str()))
+    {
+    }
+
+    template <class T>
+    T get()
+    {
+      T v;
+      if (!m_cur.fetch(v))
+        throw runtime_error("truncated cache file");
+      return v;
+    }
+
+    /// get a count of things of at least given size each
+    size_t get_count(size_t bytes)
+    {
+      const uint64_t n = get<uint64_t>();
+      if (n > (m_size - min(m_cur.pos(), m_size)) / max<size_t>(bytes, 1))
+        throw runtime_error("broken cache file");
+      return n;
+    }
+
+    string get_string()
+    {
+      string s(get_count(1), '\0');
+      if (!s.empty() && m_cur.read(&s[0], s.size()) != s.size())
+        throw runtime_error("truncated cache file");
+      return s;
+    }
+
+    map<string, string> get_map()
+    {
+      map<string, string> m;
+      for (size_t n = get_count(2 * sizeof(uint64_t)); n != 0; --n)
+      {
+        string key = get_string();
+        m[key] = get_string();
+      }
+      return m;
+    }
+
+    /// read aligned data, mapped if possible
+    template <class T>
+    storage<T> blob(size_t n)
+    {
+      const uint64_t pos = (m_cur.pos() + blob_alignment - 1) / blob_alignment * blob_alignment;
+      if (pos > m_size || n > (m_size - pos) / sizeof(T))
+        throw runtime_error("truncated cache file");
+
+      // skip the padding also for empty blobs, the writer always pads
+      m_cur.set(pos);
+      if (n == 0)
+        return storage<T>();
+
+      storage<T> s = mapped_storage<T>(m_file, pos, n);
+      if (!s.data())
+      {
+        s = storage<T>(n);
+        if (m_cur.read(s.data(), n) != n)
+          throw runtime_error("truncated cache file");
+      }
+      m_cur.set(pos + n * sizeof(T));
+      return s;
+    }
+
+    template <class T>
+    image<T> get_image()
+    {
+      const size_t c = get<uint64_t>(), w = get<uint64_t>(), h = get<uint64_t>();
+      if (w != 0 && h != 0 && c > m_size / w / h)
+        throw runtime_error("broken cache file");
+      return image<T>(c, w, h, blob<T>(c * w * h));
+    }
+  };
+
+  /// copy of scan sharing its image data
+  oct_scan snapshot(const oct_scan &s)
+  {
+    oct_scan r;
+    r.fundus = s.fundus.share();
+    r.range = s.range;
+    copy(s.size, s.size + 3, r.size);
+    r.tomogram = s.tomogram.share();
+    copy(s.dimensions, s.dimensions + 3, r.dimensions);
+    for (const auto &c: s.contours)
+      r.contours[c.first] = c.second.share();
+    r.info = s.info;
+    r.reduced = s.reduced;
+    r.images = s.images;
+    return r;
+  }
+
+  void write_cache(const string &path, const source_id &source, const map<string, string> &info, const map<string, oct_scan> &scans)
+  {
+    writer w(path);
+    w.write(cache_magic, sizeof(cache_magic));
+    w.put(cache_version);
+    w.put(source.size);
+    w.put(source.hash);
+    w.put_map(info);
+    w.put(uint64_t(scans.size()));
+    for (const auto &e: scans)
+    {
+      const oct_scan &s = e.second;
+      w.put_string(e.first);
+      w.put_map(s.info);
+      w.write(s.size, sizeof(s.size));
+      w.put(uint64_t(s.range.minx));
+      w.put(uint64_t(s.range.maxx));
+      w.put(uint64_t(s.range.miny));
+      w.put(uint64_t(s.range.maxy));
+      for (size_t i = 0; i != 3; ++i)
+        w.put(uint64_t(s.dimensions[i]));
+      w.put(uint32_t(s.reduced));
+      w.put_image(s.fundus);
+
+      w.put(uint64_t(s.tomogram.width()));
+      w.put(uint64_t(s.tomogram.height()));
+      w.put(uint64_t(s.tomogram.depth()));
+      w.blob(s.tomogram.data(), s.tomogram.width() * s.tomogram.height() * s.tomogram.depth());
+
+      w.put(uint64_t(s.contours.size()));
+      for (const auto &c: s.contours)
+      {
+        w.put_string(c.first);
+        w.put_image(c.second);
+      }
+
+      // additional images are stored decoded
+      vector<pair<string, const image<uint8_t> *>> images;
+      for (const auto &i: s.images)
+      {
+        try
+        {
+          images.push_back(make_pair(i.first, &i.second.get()));
+        }
+        catch (exception &)
+        {
+        }
+      }
+      w.put(uint64_t(images.size()));
+      for (const auto &i: images)
+      {
+        w.put_string(i.first);
+        w.put_image(*i.second);
+      }
+    }
+    w.close();
+  }
+
+  /// cache file with size and time of last use
+  struct cache_entry
+  {
+    string path;
+    uint64_t size, used;
+  };
+
+  vector<cache_entry> cache_entries(const string &dir)
+  {
+    vector<cache_entry> entries;
+#ifdef _WIN32
+    WIN32_FIND_DATAA d;
+    HANDLE h = FindFirstFileA((dir + "/*.cache").c_str(), &d);
+    if (h == INVALID_HANDLE_VALUE)
+      return entries;
+    do
+    {
+      entries.push_back({dir + "/" + d.cFileName, (uint64_t(d.nFileSizeHigh) << 32) | d.nFileSizeLow,
+                         (uint64_t(d.ftLastWriteTime.dwHighDateTime) << 32) | d.ftLastWriteTime.dwLowDateTime});
+    } while (FindNextFileA(h, &d));
+    FindClose(h);
+#else
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+      return entries;
+    while (dirent *e = readdir(d))
+    {
+      const string name = e->d_name;
+      struct stat st;
+      if (name.size() > 6 && name.compare(name.size() - 6, 6, ".cache") == 0 && stat((dir + "/" + name).c_str(), &st) == 0)
+        entries.push_back({dir + "/" + name, uint64_t(st.st_size), uint64_t(st.st_mtime)});
+    }
+    closedir(d);
+#endif
+    return entries;
+  }
+
+  /// remove least recently used cache files beyond limit bytes
+  void evict(const string &dir, uint64_t limit)
+  {
+    vector<cache_entry> entries = cache_entries(dir);
+    sort(entries.begin(), entries.end(), [](const cache_entry &a, const cache_entry &b) { return a.used > b.used; });
+
+    uint64_t bytes = 0;
+    for (const cache_entry &e: entries)
+    {
+      bytes += e.size;
+      if (bytes > limit)
+        remove(e.path.c_str());
+    }
+  }
+
+
+  /// identity of given source file
+  source_id identify(const char *path)
+  {
+    const uint64_t size = file_size(path);
+    file f(path, "rbm");
+
+    // pieces hashed concurrently, then their hashes
+    vector<uint64_t> hashes((size + hash_chunk_bytes - 1) / hash_chunk_bytes);
+    parallel_for(0, hashes.size(), [&](size_t i) {
+      const uint64_t pos = uint64_t(i) * hash_chunk_bytes;
+      const size_t n = min<uint64_t>(hash_chunk_bytes, size - pos);
+      if (f.data() && f.size() == size)
+        hashes[i] = content_hash(f.data() + pos, n, i);
+      else
+      {
+        vector<char> buf(n);
+        if (f.read_at(pos, buf.data(), n) != n)
+          throw runtime_error(string("could not read \"") + path + "\"");
+        hashes[i] = content_hash(buf.data(), n, i);
+      }
+    });
+
+    return source_id{size, content_hash(reinterpret_cast<const char *>(hashes.data()), hashes.size() * sizeof(uint64_t), size)};
+  }
+
+  /// cache file for the decoded contents of source loaded with given options
+  string cache_path(const string &dir, const source_id &source, const oct_load_options &options)
+  {
+    uint64_t h = 0xcbf29ce484222325ull;
+    h = fnv1a(h, &cache_version, sizeof(cache_version));
+    h = fnv1a(h, &source.size, sizeof(source.size));
+    h = fnv1a(h, &source.hash, sizeof(source.hash));
+    for (const string &s: options.scans)
+      h = fnv1a(h, s.c_str(), s.size() + 1);
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.cache", static_cast<unsigned long long>(h));
+    return dir + name;
+  }
+
+  /// load decoded subject from cache file, false if not cached
+  bool read_cache(const string &cache, const source_id &source, oct_subject &subject)
+  {
+    try
+    {
+      reader r(cache);
+      char magic[sizeof(cache_magic)];
+      for (char &c: magic)
+        c = r.get<char>();
+      if (memcmp(magic, cache_magic, sizeof(magic)) != 0 || r.get<uint32_t>() != cache_version)
+        throw runtime_error("outdated cache file");
+      if (r.get<uint64_t>() != source.size || r.get<uint64_t>() != source.hash)
+        throw runtime_error("cache file of other contents");
+
+      map<string, string> info = r.get_map();
+      map<string, oct_scan> scans;
+      for (size_t n = r.get_count(1); n != 0; --n)
+      {
+        oct_scan &s = scans[r.get_string()];
+        s.info = r.get_map();
+        for (float &v: s.size)
+          v = r.get<float>();
+        s.range.minx = r.get<uint64_t>();
+        s.range.maxx = r.get<uint64_t>();
+        s.range.miny = r.get<uint64_t>();
+        s.range.maxy = r.get<uint64_t>();
+        for (size_t &d: s.dimensions)
+          d = r.get<uint64_t>();
+        s.reduced = r.get<uint32_t>();
+        s.fundus = r.get_image<uint8_t>();
+
+        const size_t w = r.get<uint64_t>(), h = r.get<uint64_t>(), d = r.get<uint64_t>();
+        if (w != 0 && h != 0 && d > size_t(-1) / w / h)
+          throw runtime_error("broken cache file");
+        s.tomogram = volume<uint8_t>(w, h, d, r.blob<uint8_t>(w * h * d));
+
+        for (size_t i = r.get_count(1); i != 0; --i)
+        {
+          string name = r.get_string();
+          s.contours[name] = r.get_image<float>();
+        }
+
+        for (size_t i = r.get_count(1); i != 0; --i)
+        {
+          string name = r.get_string();
+          auto img = make_shared<image<uint8_t>>(r.get_image<uint8_t>());
+          s.images[name] = deferred_image([img]() { return img->share(); });
+        }
+      }
+
+      subject.info = move(info);
+      subject.scans = move(scans);
+    }
+    catch (exception &e)
+    {
+      // missing files are the usual cache misses, others are dropped
+      FILE *f = fopen(cache.c_str(), "rb");
+      if (!f)
+        return false;
+      fclose(f);
+      qDebug() << "dropping cache file" << cache.c_str() << ":" << e.what();
+      remove(cache.c_str());
+      return false;
+    }
+
+    // mark as recently used
+#ifdef _WIN32
+    _utime(cache.c_str(), 0);
+#else
+    utime(cache.c_str(), 0);
+#endif
+    return true;
+  }
+
+}
+
+subject_cache::subject_cache(const string &dir, uint64_t limit)
+  : m_dir(dir), m_limit(limit), m_stop(false)
+{
+}
+
+subject_cache::~subject_cache()
+{
+  {
+    lock_guard<mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_stopped.notify_all();
+  for (store_thread &t: m_threads)
+    t.thread.join();
+}
+
+oct_subject subject_cache::load(const char *path, const oct_load_options &options)
+{
+  if (m_dir.empty() || options.payload != oct_payload::all || options.reduce != 0 || options.cache_bytes != 0)
+    return oct_subject(path, options);
+
+  string cache;
+  source_id source = {0, 0};
+  try
+  {
+    source = identify(path);
+    cache = cache_path(m_dir, source, options);
+    oct_subject subject;
+    if (read_cache(cache, source, subject))
+      return subject;
+  }
+  catch (exception &)
+  {
+    // load from the file instead
+    cache.clear();
+  }
+
+  oct_subject subject(path, options);
+  if (!cache.empty())
+    store(cache, source, subject);
+  return subject;
+}
+
+void subject_cache::store(const string &cache, const source_id &source, const oct_subject &subject)
+{
+  // the snapshot shares image data, so the subject may be used meanwhile
+  auto info = make_shared<map<string, string>>(subject.info);
+  auto scans = make_shared<map<string, oct_scan>>();
+  vector<shared_ptr<progressive_tomogram>> pending;
+  for (const auto &e: subject.scans)
+  {
+    scans->insert(make_pair(e.first, snapshot(e.second)));
+    if (e.second.progress)
+      pending.push_back(e.second.progress);
+  }
+
+  const string dir = m_dir;
+  const uint64_t limit = m_limit;
+  auto write = [cache, source, dir, limit, info, scans]() {
+    try
+    {
+      // complete files only, in case of concurrent loads or crashes
+      const string tmp = cache + ".tmp";
+      write_cache(tmp, source, *info, *scans);
+      remove(cache.c_str());
+      if (rename(tmp.c_str(), cache.c_str()) != 0)
+      {
+        remove(tmp.c_str());
+        throw runtime_error("could not rename cache file");
+      }
+      evict(dir, limit);
+    }
+    catch (exception &e)
+    {
+      qDebug() << "could not store" << cache.c_str() << ":" << e.what();
+    }
+  };
+
+  if (pending.empty())
+  {
+    write();
+    return;
+  }
+
+  lock_guard<mutex> lock(m_mutex);
+
+  // join threads done storing
+  for (auto i = m_threads.begin(); i != m_threads.end();)
+  {
+    if (*i->done)
+    {
+      i->thread.join();
+      i = m_threads.erase(i);
+    }
+    else
+      ++i;
+  }
+
+  auto done = make_shared<bool>(false);
+  m_threads.push_back(store_thread{thread([this, cache, pending, write, done]() {
+    {
+      // poll, as the tomograms do not signal single waiters
+      unique_lock<mutex> lock(m_mutex);
+      for (const auto &p: pending)
+        while (!p->done())
+          if (m_stopped.wait_for(lock, chrono::milliseconds(50), [this]() { return m_stop; }))
+          {
+            *done = true;
+            return;
+          }
+
+      // black slices of failed decodes are not to be served again
+      for (const auto &p: pending)
+        if (p->failed())
+        {
+          qDebug() << "not caching" << cache.c_str() << ": slices failed to decode";
+          *done = true;
+          return;
+        }
+    }
+
+    write();
+
+    lock_guard<mutex> lock(m_mutex);
+    *done = true;
+  }), done});
+}
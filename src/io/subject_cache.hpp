@@ -0,0 +1,91 @@
+/*
+ * Copyright 2015 TU Chemnitz
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SUBJECT_CACHE_HPP
+#define SUBJECT_CACHE_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "../core/oct_data.hpp"
+
+/// decoded subjects kept in a directory
+/**
+ * Fully decoded subjects are stored in cache files named after a hash of the
+ * whole file contents, the selected scans and the cache version, which is to
+ * be increased whenever readers decode differently. Cache files record the
+ * size and hash of their source and are used only if both match. Independent
+ * of the file name, so copies and renamed files share one entry.
+ * Images are mapped from cache files where possible, so loading a cached
+ * subject takes little more than reading the file. The least recently used
+ * files beyond the size limit are removed.
+ *
+ * Subjects still being decoded progressively are stored by threads owned by
+ * the cache once they are complete. The destructor abandons stores still
+ * waiting and joins the threads.
+ */
+class subject_cache
+{
+  struct store_thread
+  {
+    std::thread thread;
+    std::shared_ptr<bool> done; ///< guarded by m_mutex
+  };
+
+  const std::string m_dir;
+  const std::uint64_t m_limit;
+  std::mutex m_mutex;
+  std::condition_variable m_stopped; ///< signals m_stop
+  bool m_stop;
+  std::list<store_thread> m_threads;
+
+public:
+
+  /// identity of a source file, its size and a hash of its whole contents
+  struct source_id
+  {
+    std::uint64_t size, hash;
+  };
+
+  /// cache in given directory of at most limit bytes, disabled if dir is empty
+  explicit subject_cache(const std::string &dir = std::string(), std::uint64_t limit = std::uint64_t(8) << 30);
+
+  /// stop pending stores
+ ~subject_cache();
+
+  subject_cache(const subject_cache&) = delete;
+  subject_cache& operator=(const subject_cache&) = delete;
+
+  /// load subject, from the cache if it was fully decoded before
+  /**
+   * Only fully decoded subjects are cached, other payloads, reduced
+   * resolution and tomograms kept out of core are loaded from the file.
+   * Failures of the cache are logged only. May be called from several
+   * threads.
+   */
+  oct_subject load(const char *path, const oct_load_options &options);
+
+private:
+
+  void store(const std::string &cache, const source_id &source, const oct_subject &subject);
+};
+
+#endif // inclusion guard
@@ -16,6 +16,9 @@
 
 #include "xml.hpp"
 
+#include <algorithm>
+#include <cctype>
+#include <cstring>
 #include <sstream>
 #include <stdexcept>
 
@@ -23,13 +26,26 @@
 
 using namespace std;
 
+namespace
+{
+
+  /// same as xml_tag(), for names known at run time only
+  uint64_t name_hash(const char *s)
+  {
+    uint64_t h = 14695981039346656037ull;
+    for (; *s; ++s)
+      h = (h ^ static_cast<unsigned char>(*s)) * 1099511628211ull;
+    return h;
+  }
+
+}
+
 struct xml::impl
 {
   XML_Parser p;
-  std::function<void (const char *, const char **)> start;
-  std::function<void (const char *)> end;
-  std::function<void (const char *, std::size_t)> data;
-  
+  callbacks cb;
+  void *user;
+
   static void xml_start(void *userData, const XML_Char *name, const XML_Char **atts);
   static void xml_end(void *userData, const XML_Char *name);
   static void xml_data(void *userData, const XML_Char *data, int len);
@@ -37,21 +53,24 @@ struct xml::impl
 
 void xml::impl::xml_start(void *userData, const XML_Char *name, const XML_Char **attr)
 {
-  static_cast<impl *>(userData)->start(name, attr);
+  impl &m = *static_cast<impl *>(userData);
+  m.cb.start(m.user, xml_name(name, name_hash(name)), attr);
 }
 
 void xml::impl::xml_end(void *userData, const XML_Char *name)
 {
-  static_cast<impl *>(userData)->end(name);
+  impl &m = *static_cast<impl *>(userData);
+  m.cb.end(m.user, xml_name(name, name_hash(name)));
 }
 
 void xml::impl::xml_data(void *userData, const XML_Char *data, int len)
 {
-  static_cast<impl *>(userData)->data(data, len);
+  impl &m = *static_cast<impl *>(userData);
+  m.cb.data(m.user, data, len);
 }
 
-xml::xml(function<void (const char *, const char **)> &&start, function<void (const char *)> &&end, function<void (const char *, size_t)> &&data)
-  : m(new impl{XML_ParserCreate(NULL), move(start), move(end), move(data)})
+xml::xml(const callbacks &cb, void *user)
+  : m(new impl{XML_ParserCreate(NULL), cb, user})
 {
   XML_SetUserData(m->p, m.get());
   XML_SetElementHandler(m->p, impl::xml_start, impl::xml_end);
@@ -72,3 +91,45 @@ void xml::operator()(const char *buf, size_t bufsize, bool is_final) const
     throw runtime_error(os.str());
   }
 }
+
+string xml::root(const char *data, size_t size)
+{
+  const char *p = data, *end = data + size;
+  if (size >= 3 && memcmp(p, "\xef\xbb\xbf", 3) == 0)
+    p += 3;
+
+  while (p != end)
+  {
+    if (isspace(static_cast<unsigned char>(*p)))
+    {
+      ++p;
+      continue;
+    }
+
+    if (*p != '<' || end - p < 2)
+      return string();
+
+    // skip markup before the root element
+    const char *close;
+    if (end - p >= 4 && memcmp(p, "<!--", 4) == 0)
+      close = "-->";
+    else if (p[1] == '?')
+      close = "?>";
+    else if (p[1] == '!')
+      close = ">";
+    else
+    {
+      const char *b = p + 1, *e = b;
+      while (e != end && !isspace(static_cast<unsigned char>(*e)) && *e != '>' && *e != '/')
+        ++e;
+      return e != end ? string(b, e) : string();
+    }
+
+    p = search(p + 2, end, close, close + strlen(close));
+    if (p == end)
+      return string();
+    p += strlen(close);
+  }
+
+  return string();
+}
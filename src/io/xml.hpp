@@ -17,9 +17,49 @@
 #ifndef XML_HPP
 #define XML_HPP
 
-#include <functional>
+#include <cstdint>
+#include <cstring>
 #include <memory>
+#include <string>
 
+/// 64 bit FNV-1a hash of a tag name, usable as case label
+constexpr std::uint64_t xml_tag(const char *s, std::uint64_t h = 14695981039346656037ull)
+{
+  return *s ? xml_tag(s + 1, (h ^ static_cast<unsigned char>(*s)) * 1099511628211ull) : h;
+}
+
+/// element name as given by the parser
+class xml_name
+{
+  const char *m_str;
+  std::uint64_t m_hash;
+
+public:
+
+  xml_name(const char *str, std::uint64_t hash)
+    : m_str(str), m_hash(hash)
+  {
+  }
+
+  /// name, valid during the handler call only
+  const char *c_str() const
+  {
+    return m_str;
+  }
+
+  /// same as xml_tag(c_str())
+  std::uint64_t hash() const
+  {
+    return m_hash;
+  }
+
+  bool operator==(const char *s) const
+  {
+    return std::strcmp(m_str, s) == 0;
+  }
+};
+
+/// SAX parser, see xml_parser
 class xml
 {
 
@@ -28,13 +68,66 @@ class xml
 
 public:
 
-  xml(std::function<void (const char *, const char **)> &&start,
-    std::function<void (const char *)> &&end,
-    std::function<void (const char *, std::size_t)> &&data);
+  /// handler functions, called with the user pointer
+  struct callbacks
+  {
+    void (*start)(void *user, const xml_name &name, const char **attr);
+    void (*end)(void *user, const xml_name &name);
+    void (*data)(void *user, const char *data, std::size_t size);
+  };
+
+  xml(const callbacks &cb, void *user);
  ~xml();
 
   void operator()(const char *data, std::size_t bufsize, bool isFinal) const;
 
+  /// name of the root element of a document starting with given data
+  /**
+   * Skips declaration, comments and doctype. Empty if the data does not look
+   * like XML or ends before the root element.
+   */
+  static std::string root(const char *data, std::size_t size);
+
+};
+
+/// SAX parser calling start(), end() and data() of a handler
+/**
+ * The handler members are called directly and names are passed without
+ * copying them, so parsing allocates nothing per element:
+ *
+ *     void start(const xml_name &name, const char **attr);
+ *     void end(const xml_name &name);
+ *     void data(const char *data, std::size_t size);
+ *
+ * Handlers dispatch in constant time by switching on name.hash() with
+ * xml_tag("...") case labels. Names are told apart by their 64 bit hashes
+ * only.
+ */
+template <class Handler>
+class xml_parser
+  : public xml
+{
+  static void call_start(void *h, const xml_name &name, const char **attr)
+  {
+    static_cast<Handler *>(h)->start(name, attr);
+  }
+
+  static void call_end(void *h, const xml_name &name)
+  {
+    static_cast<Handler *>(h)->end(name);
+  }
+
+  static void call_data(void *h, const char *data, std::size_t size)
+  {
+    static_cast<Handler *>(h)->data(data, size);
+  }
+
+public:
+
+  explicit xml_parser(Handler &h)
+    : xml(callbacks{&call_start, &call_end, &call_data}, &h)
+  {
+  }
 };
 
 #endif // inclusion guard
@@ -16,12 +16,14 @@
 
 #include "main.hpp"
 
+#include <algorithm>
 #include <sstream>
 
 #include <QApplication>
 #include <QGLWidget>
 #include <QLabel>
 #include <QMouseEvent>
+#include <QStandardPaths>
 #ifdef BUILD_STANDALONE
 #include <QtPlugin>
 Q_IMPORT_PLUGIN (QWindowsIntegrationPlugin);
@@ -29,6 +31,8 @@ Q_IMPORT_PLUGIN (QWindowsIntegrationPlugin);
 
 #include <QDebug>
 
+#include "core/allocator.hpp"
+#include "core/progressive.hpp"
 #include "gl_content.hpp"
 #include "io/save_uoctml.hpp"
 
@@ -37,6 +41,44 @@ using namespace std;
 namespace
 {
 
+/// tomograms larger than this are kept out of core
+const size_t out_of_core_bytes = size_t(1) << 30;
+
+/// memory for decoded slices of tomograms kept out of core
+const size_t slice_cache_bytes = size_t(256) << 20;
+
+/// log memory diagnostics, enabled by --diagnostics
+bool diagnostics = false;
+
+/// log huge page backing of a fully decoded tomogram
+void report_huge_pages(const oct_scan &s)
+{
+    // reads all of /proc/self/smaps on Linux, so on request only
+    if (!diagnostics || !s.tomogram.data() || s.progress)
+        return;
+
+    const size_t bytes = s.tomogram.width() * s.tomogram.height() * s.tomogram.depth();
+    qDebug() << "tomogram:" << huge_page_bytes(s.tomogram.data(), bytes) << "of" << bytes << "bytes in huge pages";
+}
+
+/// options to load a scan of a dataset with, at 1/2^reduce of its resolution
+oct_load_options scan_options(const dataset &p, const string &id, unsigned reduce)
+{
+    oct_load_options options = p.m_options;
+    options.scans.insert(id);
+    options.reduce = reduce;
+
+    // very large tomograms are read slice by slice on demand
+    const oct_scan &meta = p.m_subject.scans.at(id);
+    if (options.reduce == 0 && meta.dimensions[0] * meta.dimensions[1] * meta.dimensions[2] > out_of_core_bytes)
+        options.cache_bytes = slice_cache_bytes;
+
+    return options;
+}
+
+/// refused while quick loaded scans are shown at reduced resolution
+const char reduced_message[] = "The scan is still shown at reduced resolution. Try again once the full resolution is loaded, or use Load instead of Quick Load.";
+
 string info(const oct_subject &subject, const oct_scan &scan)
 {
     vector<string> subject_tags = {"name", "birth date", "sex"};
@@ -155,13 +197,26 @@ unique_ptr<gl_content> make_render_mip(function<void ()> &&update, const oct_sca
 unique_ptr<gl_content> make_render_sectors(function<void ()> &&update, const oct_scan &scan);
 unique_ptr<gl_content> make_render_slice(function<void ()> &&update, const vector<pair<const oct_scan *, observable<size_t> *>> &scans, observable<size_t> &demux, observable<size_t> &key);
 
-dataset::dataset(const QString &path)
-    : m_subject(path.toLocal8Bit().data())
+string main_window::cache_dir()
+{
+    // decoded files open quickly the next time
+    const QString dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/decoded";
+    return QDir().mkpath(dir) ? dir.toLocal8Bit().data() : string();
+}
+
+dataset::dataset(const QString &path, const oct_load_options &options)
+    : m_subject(path.toLocal8Bit().data(), options)
     , m_scan(nullptr)
 {
 }
 
-void main_window::load(unique_ptr<dataset> &p)
+dataset::~dataset()
+{
+    if (m_refined)
+        m_refined->cancel();
+}
+
+void main_window::load(unique_ptr<dataset> &p, bool quick)
 {
     p.reset(0);
     update();
@@ -185,16 +240,21 @@ void main_window::load(unique_ptr<dataset> &p)
     {
         try
         {
-            p.reset(new dataset(path));
+            // list the scans first and decode only the selected one
+            oct_load_options options;
+            options.payload = oct_payload::metadata;
+            p.reset(new dataset(path, options));
 
             if (p->m_subject.scans.empty())
                 throw runtime_error("No scans in this file.");
 
+            // quick load decodes at a quarter of the resolution and loads
+            // the full resolution in the background
+            p->m_path = path.toLocal8Bit().data();
+            p->m_options.reduce = quick ? 2 : 0;
+
             if (p->m_subject.scans.size() == 1)
-            {
-                p->m_scan = &p->m_subject.scans.begin()->second;
-                update(p.get());
-            }
+                select(p.get(), p->m_subject.scans.begin()->first);
             else
             {
                 p->m_dialog.reset(new QDialog(this));
@@ -207,7 +267,7 @@ void main_window::load(unique_ptr<dataset> &p)
                     auto d = e.second.info.find("scan date");
                     if (d != e.second.info.end())
                         s += " (" + d->second + ")";
-                    l->addWidget(new my_button(*this, p.get(), e.second, QString::fromUtf8(s.c_str())));
+                    l->addWidget(new my_button(*this, p.get(), e.first, QString::fromUtf8(s.c_str())));
                 }
                 p->m_dialog->show();
             }
@@ -219,6 +279,157 @@ void main_window::load(unique_ptr<dataset> &p)
     }
 }
 
+void main_window::select(dataset *p, const string &id)
+{
+    try
+    {
+        oct_load_options options = scan_options(*p, id, p->m_options.reduce);
+
+        // show the middle slice while the others are decoded
+        options.progressive = true;
+        oct_subject subject = cache.load(p->m_path.c_str(), options);
+
+        auto i = subject.scans.find(id);
+        if (i == subject.scans.end())
+            throw runtime_error("Could not load the selected scan.");
+
+        // the other scans are kept, saving loads those not loaded yet
+        oct_scan &scan = p->m_subject.scans[id];
+        scan = move(i->second);
+        p->m_loaded.insert(id);
+
+        if (scan.reduced != 0)
+        {
+            options.reduce = 0;
+            start_refinement(p, id, options);
+        }
+        else if (p->m_refined)
+        {
+            p->m_refined->cancel();
+            p->m_refined.reset();
+        }
+
+        p->m_scan = &scan;
+        update(p);
+        report_huge_pages(scan);
+    }
+    catch (exception &e)
+    {
+        QMessageBox::critical(this, "Error", e.what());
+    }
+}
+
+main_window::~main_window()
+{
+    for (auto &w: workers)
+        w.first.join();
+}
+
+void main_window::start_refinement(dataset *p, const string &id, const oct_load_options &options)
+{
+    // join workers done, those still running are left to finish
+    for (auto i = workers.begin(); i != workers.end();)
+    {
+        bool done;
+        {
+            lock_guard<mutex> lock(i->second->mutex);
+            done = i->second->done;
+        }
+        if (done)
+        {
+            i->first.join();
+            i = workers.erase(i);
+        }
+        else
+            ++i;
+    }
+
+    // replaces any earlier refinement, whose result is then dropped
+    if (p->m_refined)
+        p->m_refined->cancel();
+    auto job = make_shared<refinement>(id);
+    p->m_refined = job;
+    const string path = p->m_path;
+    workers.push_back(make_pair(thread([this, job, path, options]() {
+        unique_ptr<oct_subject> subject;
+        try
+        {
+            subject.reset(new oct_subject(cache.load(path.c_str(), options)));
+        }
+        catch (exception &e)
+        {
+            qDebug() << "refining to full resolution failed:" << e.what();
+        }
+
+        // dropped results are freed here, off the GUI thread
+        lock_guard<mutex> lock(job->mutex);
+        if (!job->cancelled)
+            job->subject = move(subject);
+        job->done = true;
+    }), job));
+    r.start();
+}
+
+void main_window::refine(unique_ptr<dataset> &p)
+{
+    if (!p || !p->m_refined)
+        return;
+
+    unique_ptr<oct_subject> subject;
+    {
+        lock_guard<mutex> lock(p->m_refined->mutex);
+        if (!p->m_refined->done)
+            return;
+        subject = move(p->m_refined->subject);
+    }
+    const string id = p->m_refined->id;
+    p->m_refined.reset();
+    if (!subject)
+        return;
+
+    // only if the scan is still shown, replaced in place so pointers to it
+    // stay valid
+    auto i = subject->scans.find(id);
+    auto j = p->m_subject.scans.find(id);
+    if (i == subject->scans.end() || j == p->m_subject.scans.end() || &j->second != p->m_scan)
+        return;
+
+    j->second = move(i->second);
+    const size_t slice = p->m_slice;
+    update(p.get());
+    p->m_slice = slice;
+    report_huge_pages(j->second);
+}
+
+bool main_window::progress(unique_ptr<dataset> &p)
+{
+    if (!p)
+        return false;
+
+    for (auto &e: p->m_subject.scans)
+    {
+        if (&e.second != p->m_scan || !e.second.progress)
+            continue;
+
+        // show slices as they are decoded
+        if (!e.second.progress->done())
+        {
+            for (auto &w: p->m_widgets)
+                if (w)
+                    w->update();
+            return true;
+        }
+
+        // all slices decoded, rebuild views that need the whole tomogram
+        e.second.progress.reset();
+        const size_t slice = p->m_slice;
+        update(p.get());
+        p->m_slice = slice;
+        report_huge_pages(e.second);
+    }
+    return false;
+}
+
 void main_window::load_many(QStringList &paths)
 {
     ostringstream allexts;
@@ -264,6 +475,15 @@ void main_window::load_jpeg_exporter(const std::unique_ptr<dataset> &p)
         return;
     }
 
+    if (p->m_scan->reduced != 0)
+    {
+        QMessageBox::information(this, "Export", reduced_message);
+        return;
+    }
+
+    if (p->m_scan->progress)
+        p->m_scan->progress->wait();
+
     //choose contours here
     ChooseContoursWidget chooseContours(p->m_scan->contours.size());
     if (chooseContours.exec() == QDialog::Accepted)
@@ -483,7 +703,7 @@ void main_window::convertToUoctml(bool anonymized)
 
     QEventLoop loop;
     loop.processEvents();
-    Converter::toUoctml(inputPaths, progress, *output, anonymized);
+    Converter::toUoctml(inputPaths, progress, *output, anonymized, compress->isChecked());
     loop.exit();
 
     acceptButton->show();
@@ -493,7 +713,9 @@ void main_window::convertToUoctml(bool anonymized)
 void main_window::update(dataset *p)
 {
     const oct_scan &s = *p->m_scan;
-    p->m_slice = s.tomogram.depth() / 2; // initially select middle slice
+    p->m_slice = s.dimensions[2] / 2; // initially select middle slice, it is decoded first
+    if (s.progress)
+        u.start();
     p->m_widgets[0].reset(new QLabel(QString::fromUtf8(::info(p->m_subject, s).c_str())));
     p->m_widgets[1].reset(new gl_widget(bind(&make_render_fundus, placeholders::_1, cref(s), ref(p->m_slice))));
     p->m_widgets[2].reset(new gl_widget(bind(&make_render_mip, placeholders::_1, cref(s), ref(key))));
@@ -552,10 +774,35 @@ void main_window::save(const unique_ptr<dataset> &p, bool anonymize)
         if (!p)
             throw runtime_error("dataset not loaded");
 
+        // reduced data would be written as if it were the original
+        for (auto &e: p->m_subject.scans)
+            if (e.second.reduced != 0)
+                throw runtime_error(reduced_message);
+
         QString path = QFileDialog::getSaveFileName(this, "Save File", 0, "UOCTML (*.uoctml)");
+        if (path == "")
+            return;
 
-        if (path != "")
-            save_uoctml(path.toLocal8Bit().data(), p->m_subject, anonymize);
+        // all scans are written, also those never selected
+        for (auto &e: p->m_subject.scans)
+        {
+            if (p->m_loaded.count(e.first))
+                continue;
+
+            oct_subject subject = cache.load(p->m_path.c_str(), scan_options(*p, e.first, 0));
+            auto i = subject.scans.find(e.first);
+            if (i == subject.scans.end())
+                throw runtime_error("Could not load scan " + e.first + ".");
+            e.second = move(i->second);
+            p->m_loaded.insert(e.first);
+        }
+
+        // slices still being decoded are needed
+        for (auto &e: p->m_subject.scans)
+            if (e.second.progress)
+                e.second.progress->wait();
+
+        save_uoctml(path.toLocal8Bit().data(), p->m_subject, anonymize, compress->isChecked());
     }
     catch (exception &e)
     {
@@ -568,6 +815,10 @@ int main(int argc, char **argv)
     QApplication app(argc, argv);
     app.setAttribute(Qt::AA_DontCreateNativeWidgetSiblings);
 
+    for (int i = 1; i < argc; ++i)
+        if (string(argv[i]) == "--diagnostics")
+            diagnostics = true;
+
     main_window w;
     w.show();
 
@@ -17,8 +17,15 @@
 #ifndef MAIN_HPP
 #define MAIN_HPP
 
+#include <list>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
 
+#include <QAction>
 #include <QFileDialog>
 #include <QGridLayout>
 #include <QKeyEvent>
@@ -34,6 +41,7 @@
 #include "chooseContoursWidget.hpp"
 #include "glSectorWidget.hpp"
 #include "io/exportJpeg.hpp"
+#include "io/subject_cache.hpp"
 
 #include "core/oct_data.hpp"
 #include "observer.hpp"
@@ -41,12 +49,39 @@
 struct oct_subject;
 struct oct_scan;
 
+/// full resolution subject decoded in the background after quick open
+struct refinement
+{
+
+  explicit refinement(const std::string &id) : id(id), done(false), cancelled(false) { }
+
+  /// drop the result, also if still decoding
+  void cancel()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    cancelled = true;
+    subject.reset();
+  }
+
+  const std::string id; ///< scan to refine
+  std::mutex mutex;
+  bool done; ///< guarded by mutex
+  bool cancelled; ///< guarded by mutex
+  std::unique_ptr<oct_subject> subject; ///< guarded by mutex, null if decoding failed
+
+};
+
 struct dataset
 {
 
-  dataset(const QString &path);
+  dataset(const QString &path, const oct_load_options &options = oct_load_options());
+ ~dataset();
 
-  oct_subject m_subject;
+  oct_subject m_subject; ///< scans not in m_loaded hold metadata only
+  std::set<std::string> m_loaded; ///< scans with their images loaded
+  std::string m_path; ///< file to load the selected scan from
+  oct_load_options m_options; ///< options to load the selected scan with
+  std::shared_ptr<refinement> m_refined; ///< pending full resolution scan, dropped if superseded
   const oct_scan *m_scan;
   observable<std::size_t> m_slice;
   std::unique_ptr<QDialog> m_dialog;
@@ -63,19 +98,28 @@ class main_window
 public:
 
   main_window()
-    : l(&w), dummy(0), demux(0), key(0)
+    : l(&w), dummy(0), demux(0), key(0), cache(cache_dir())
    {
     menuBar()->addAction("Info", this, SLOT(info()));
+
+    // off by default, UOCTML 1.0 readers reject compressed tomograms
+    compress = new QAction("Compress Tomograms (UOCTML 2.0)", this);
+    compress->setCheckable(true);
+
     QMenu *m;
     m = menuBar()->addMenu("Main");
     m->addAction("Load", this, SLOT(load_main()));
+    m->addAction("Quick Load", this, SLOT(quick_load_main()));
     m->addAction("Save", this, SLOT(save_main()));
     m->addAction("Save anonymized", this, SLOT(save_anon_main()));
+    m->addAction(compress);
     m->addAction("Export Slices as JPEG", this, SLOT(load_jpeg_exporter_main()));
     m = menuBar()->addMenu("Compare");
     m->addAction("Load", this, SLOT(load_compare()));
+    m->addAction("Quick Load", this, SLOT(quick_load_compare()));
     m->addAction("Save", this, SLOT(save_compare()));
     m->addAction("Save anonymized", this, SLOT(save_anon_compare()));
+    m->addAction(compress);
     m->addAction("Export Slices as JPEG", this, SLOT(load_jpeg_exporter_compare()));
     m = menuBar()->addMenu("Timeline");
     m->addAction("Load Timeline", this, SLOT(load_timeline()));
@@ -84,14 +128,24 @@ public:
     m = menuBar()->addMenu("Converter");
     m->addAction("Convert files and export as JPEG and UOCTML", this, SLOT(convert()));
     m->addAction("Convert anonymized and export as JPEG and UOCTML", this, SLOT(convert_anonymized()));
+    m->addAction(compress);
     setCentralWidget(&w);
     setWindowTitle("Unified OCT Explorer");
     
     connect(&t, SIGNAL(timeout()), this, SLOT(swap()));
     t.setInterval(500);
     t.start();
+
+    connect(&r, SIGNAL(timeout()), this, SLOT(refine()));
+    r.setInterval(200);
+
+    connect(&u, SIGNAL(timeout()), this, SLOT(progress()));
+    u.setInterval(40);
   }
 
+  /// wait for background decoding
+ ~main_window();
+
   QSize sizeHint() const override
   {
     return QSize(800, 600);
@@ -99,6 +153,7 @@ public:
 
   void update(dataset *p);
   void update();
+  void select(dataset *p, const std::string &id);
 
 private slots:
 
@@ -112,6 +167,16 @@ private slots:
     load(compare);
   }
 
+  void quick_load_main()
+  {
+    load(main, true);
+  }
+
+  void quick_load_compare()
+  {
+    load(compare, true);
+  }
+
   void save_main()
   {
     save(main, false);
@@ -172,6 +237,21 @@ private slots:
     demux = 1 - demux;
   }
 
+  void refine()
+  {
+    refine(main);
+    refine(compare);
+    if (!(main && main->m_refined) && !(compare && compare->m_refined))
+      r.stop();
+  }
+
+  void progress()
+  {
+    const bool a = progress(main), b = progress(compare);
+    if (!a && !b)
+      u.stop();
+  }
+
   void info()
   {
     QMessageBox::information(this, "Info",
@@ -180,6 +260,7 @@ private slots:
       "NO WARRANTY. NOT CERTIFIED FOR CLINICAL USE.\n"
       "\n"
       "- Load one or two datasets using \"Load Main/Compare\". Supports Topcon OCT, Heidelberg Engineering OCT, Eyetec OCT, and Nidek OCT file formats.\n"
+      "- \"Quick Load\" shows Topcon OCT files at reduced resolution first and refines them in the background.\n"
       "- Drag mouse wheel in fundus panel to change active slice.\n"
       "- Drag mouse and mouse wheel to pan and zoom in slice panel.\n"
       "- Drag mouse to rotate in volume rendering panel.\n"
@@ -192,13 +273,18 @@ private slots:
 
 private:
 
+  static std::string cache_dir();
+
   void keyPressEvent(QKeyEvent *e) override
   {
     key = e->key();
     e->accept();
   }
 
-  void load(std::unique_ptr<dataset> &p);
+  void start_refinement(dataset *p, const std::string &id, const oct_load_options &options);
+  void load(std::unique_ptr<dataset> &p, bool quick = false);
+  void refine(std::unique_ptr<dataset> &p);
+  bool progress(std::unique_ptr<dataset> &p);
   void save(const std::unique_ptr<dataset> &p, bool anonymize);
   void load_many(QStringList &paths);
   void load_jpeg_exporter(const std::unique_ptr<dataset> &p);
@@ -207,11 +293,14 @@ private:
   void convertToUoctml(bool anonymized);
   void exportForExcel();
 
-  QTimer t;
+  QTimer t, r, u;
   QWidget w;
   QGridLayout l;
   observable<std::size_t> dummy, demux, key;
+  subject_cache cache; ///< decoded files, outlives the datasets
   std::unique_ptr<dataset> main, compare;
+  QAction *compress; ///< write UOCTML 2.0 with compressed tomograms, shared by the menus
+  std::list<std::pair<std::thread, std::shared_ptr<refinement>>> workers; ///< refinements, joined when done
 
 };
 
@@ -223,12 +312,12 @@ class my_button
 
   main_window &m;
   dataset *p;
-  const oct_scan &s;
+  const std::string id;
 
 public:
 
-  my_button(main_window &m, dataset *p, const oct_scan &s, const QString &text)
-    : QPushButton(text, p->m_dialog.get()), m(m), p(p), s(s)
+  my_button(main_window &m, dataset *p, const std::string &id, const QString &text)
+    : QPushButton(text, p->m_dialog.get()), m(m), p(p), id(id)
   {
     connect(this, SIGNAL(released()), this, SLOT(doit()));
   }
@@ -237,9 +326,8 @@ private slots:
 
   void doit()
   {
-    p->m_scan = &s;
     p->m_dialog->close();
-    m.update(p);
+    m.select(p, id);
   }
 
 };
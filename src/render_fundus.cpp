@@ -20,6 +20,7 @@
 #include <sstream>
 
 #include "core/oct_data.hpp"
+#include "core/progressive.hpp"
 #include "observer.hpp"
 #include "gl_content.hpp"
 
@@ -30,7 +31,7 @@ struct render_fundus
 {
 
   render_fundus(function<void ()> &&update, const oct_scan &scan, observable<size_t> &slice)
-    : gl_content(move(update)), m_width(scan.fundus.width()), m_height(scan.fundus.height()), m_depth(scan.tomogram.depth()), m_bbox(scan.range),
+    : gl_content(move(update)), m_width(scan.fundus.width()), m_height(scan.fundus.height()), m_depth(scan.dimensions[2]), m_bbox(scan.range), m_progress(scan.progress),
       m_fundus_width_in_mm(scan.size[0] * m_width / (m_bbox.maxx - m_bbox.minx)),
       m_slice(slice), m_slice_observer(slice, bind(&render_fundus::slice_changed, this))
   {
@@ -91,6 +92,24 @@ struct render_fundus
     glEnd();
     glDisable(GL_BLEND);
 
+    // mark slices not decoded yet
+    if (m_progress && m_progress->done())
+      m_progress.reset();
+    if (m_progress)
+    {
+      glEnable(GL_BLEND);
+      glColor4d(1.0, 0.0, 0.0, 0.5);
+      glBegin(GL_LINES);
+      for (size_t z = 0; z != m_depth; ++z)
+        if (!m_progress->ready(z))
+        {
+          glVertex2d(((2.0 * m_bbox.minx + 1.0) / m_width - 1.0) * w, ((2.0 * (m_bbox.miny + (m_bbox.maxy - m_bbox.miny) * (z / max(m_depth - 1.0, 1.0))) + 1.0) / m_height - 1.0) * -h);
+          glVertex2d(((2.0 * m_bbox.maxx + 1.0) / m_width - 1.0) * w, ((2.0 * (m_bbox.miny + (m_bbox.maxy - m_bbox.miny) * (z / max(m_depth - 1.0, 1.0))) + 1.0) / m_height - 1.0) * -h);
+        }
+      glEnd();
+      glDisable(GL_BLEND);
+    }
+
     glColor3d(0.0, 1.0, 0.0);
     glBegin(GL_LINES);
     glVertex2d(((2.0 * m_bbox.minx + 1.0) / m_width - 1.0) * w, ((2.0 * (m_bbox.miny + (m_bbox.maxy - m_bbox.miny) * (m_slice / max(m_depth - 1.0, 1.0))) + 1.0) / m_height - 1.0) * -h);
@@ -111,6 +130,8 @@ struct render_fundus
 
     ostringstream os;
     os << "Slice " << 1 + m_slice << "/" << m_depth;
+    if (m_progress)
+      os << ", " << m_progress->count() << " loaded";
     draw_text(5, 15, os.str().c_str());
     draw_text(5, m_view_height - 5, "1mm");
   }
@@ -153,6 +174,7 @@ struct render_fundus
   GLuint m_tx;
   size_t m_width, m_height, m_depth, m_view_width, m_view_height;
   bounding_box m_bbox;
+  shared_ptr<const progressive_tomogram> m_progress; ///< decoding tomogram, null when done
   double m_fundus_width_in_mm;
   observable<size_t> &m_slice;
   observer m_slice_observer;
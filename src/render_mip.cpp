@@ -65,6 +65,44 @@ namespace
     glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA, 256, 0, GL_RGBA, GL_UNSIGNED_BYTE, d.get());
   }
 
+  /// largest tomogram downsampled from slices when it is not loaded
+  const size_t mip_bytes = size_t(256) << 20;
+
+  /// tomogram of an out of core scan, downsampled from its slices
+  /**
+   * Reads every 2^k-th slice and averages 2^k x 2^k voxel blocks, for the
+   * smallest k that fits mip_bytes. Empty if the tomogram is loaded.
+   */
+  volume<uint8_t> downsample_slices(const oct_scan &scan)
+  {
+    if (scan.tomogram.depth() != 0 || !scan.slices)
+      return volume<uint8_t>();
+
+    slice_source &src = *scan.slices;
+    size_t f = 1;
+    while ((src.width() / f) * (src.height() / f) * (src.depth() / f) > mip_bytes)
+      f *= 2;
+
+    const size_t w = max<size_t>(src.width() / f, 1), h = max<size_t>(src.height() / f, 1), d = max<size_t>(src.depth() / f, 1);
+    volume<uint8_t> v(w, h, d);
+    image<uint8_t> slice(1, src.width(), src.height());
+    for (size_t z = 0; z != d; ++z)
+    {
+      src.read(z * f, 0, 0, view(slice));
+      for (size_t y = 0; y != h; ++y)
+        for (size_t x = 0; x != w; ++x)
+        {
+          const size_t fw = min(f, src.width() - x * f), fh = min(f, src.height() - y * f);
+          size_t sum = 0;
+          for (size_t j = 0; j != fh; ++j)
+            for (size_t i = 0; i != fw; ++i)
+              sum += slice(x * f + i, y * f + j);
+          v(x, y, z) = uint8_t(sum / (fw * fh));
+        }
+    }
+    return v;
+  }
+
   template <class T>
   void denoise(volume<T> &img)
   {
@@ -120,7 +158,8 @@ struct render_mip
 {
 
   render_mip(function<void ()> &&update, const oct_scan &scan, observable<size_t> &key)
-    : gl_content(move(update)), m_tomogram(scan.tomogram), m_contours(),
+    : gl_content(move(update)), m_downsampled(downsample_slices(scan)),
+      m_tomogram(m_downsampled.depth() != 0 ? m_downsampled : scan.tomogram), m_contours(),
       m_key(key), m_key_observer(key, bind(&render_mip::key_changed, this)), m_frustum(true), xRot(0), yRot(0), zRot(0)
   {
     glewInit();
@@ -180,7 +219,7 @@ struct render_mip
       const size_t vh = c.height();
       const float iw = scan.size[0] / vw;
       const float ih = scan.size[2] / vh;
-      const float iv = scan.size[1] / m_tomogram.height();
+      const float iv = scan.size[1] / tomogram_height(scan);
       for (size_t y = 0; y != vh; ++y)
       {
         for (size_t x = 0; x != vw; ++x)
@@ -350,6 +389,7 @@ struct render_mip
     }
   }
 
+  volume<uint8_t> m_downsampled; ///< shown instead of an out of core tomogram
   const volume<uint8_t> &m_tomogram;
   vector<contour_info> m_contours;
   observable<size_t> &m_key;
@@ -17,20 +17,41 @@
 #include <GL/glew.h>
 #include <algorithm>
 #include <cmath>
+#include <limits>
+#include <list>
 #include <map>
 #include <memory>
 #include <sstream>
+#include <tuple>
 
 #include "core/oct_data.hpp"
+#include "core/progressive.hpp"
 #include "observer.hpp"
 #include "gl_content.hpp"
 
 using namespace std;
 
+/// side length of full resolution tiles in pixels
+const size_t tile_size = 256;
+
+/// number of full resolution tiles kept
+const size_t max_tiles = 64;
+
 struct render_slice
   : public gl_content
 {
 
+  /// scan, slice, tile column and tile row
+  typedef tuple<size_t, size_t, size_t, size_t> tile_key;
+
+  /// full resolution part of a slice
+  struct tile
+  {
+    GLuint tx;
+    size_t width, height;
+    list<tile_key>::iterator order; ///< position in m_tile_order
+  };
+
   render_slice(function<void ()> &&update, const vector<pair<const oct_scan *, observable<size_t> *>> &scans, observable<size_t> &demux, observable<size_t> &key)
     : gl_content(move(update)), m_scans(scans.size()), m_demux(demux), m_demux_observer(demux, bind(&render_slice::slice_changed, this)), m_key(key), m_key_observer(key, bind(&render_slice::key_changed, this)), m_zoom(0.0), m_cx(0.0), m_cy(0.0)
   {
@@ -38,12 +59,22 @@ struct render_slice
 
     for (size_t i = 0; i != scans.size(); ++i)
     {
-      m_scans[i].width = scans[i].first->tomogram.width();
-      m_scans[i].height = scans[i].first->tomogram.height();
-      m_scans[i].depth = scans[i].first->tomogram.depth();
+      // tomograms kept out of core are shown one slice at a time
+      const shared_ptr<slice_source> &source = scans[i].first->slices;
+      m_scans[i].out_of_core = !scans[i].first->tomogram.data() && source;
+      m_scans[i].loaded = numeric_limits<size_t>::max();
+      m_scans[i].lut_ready = false;
+      m_scans[i].width = m_scans[i].out_of_core ? source->width() : scans[i].first->tomogram.width();
+      m_scans[i].height = m_scans[i].out_of_core ? source->height() : scans[i].first->tomogram.height();
+      m_scans[i].depth = m_scans[i].out_of_core ? source->depth() : scans[i].first->tomogram.depth();
       m_scans[i].aspect = scans[i].first->size[0] / scans[i].first->size[1];
       m_scans[i].width_in_mm = scans[i].first->size[0];
       m_scans[i].contours = &scans[i].first->contours;
+      m_scans[i].source = scans[i].first->slices;
+      m_scans[i].reduced = scans[i].first->reduced != 0;
+      m_scans[i].progress = scans[i].first->progress;
+      m_scans[i].data = scans[i].first->tomogram.data();
+      m_scans[i].uploaded.assign(m_scans[i].progress ? m_scans[i].depth : 0, false);
       if (m_visible.size() < scans[i].first->contours.size())
         m_visible.resize(scans[i].first->contours.size(), true);
       m_scans[i].slice = scans[i].second;
@@ -56,23 +87,55 @@ struct render_slice
       // shorthand
       size_t size = m_scans[i].width * m_scans[i].height * m_scans[i].depth;
 
-      // find min and max intensity value, discard upper and lower 1% as outliers
-      unique_ptr<uint8_t []> d(new uint8_t[size]);
-      copy_n(scans[i].first->tomogram.data(), size, d.get());
-      uint8_t *p01 = d.get() + size / 100;
-      uint8_t *p99 = d.get() + size - (size + 99) / 100;
-      nth_element(d.get(), p01, d.get() + size);
-      nth_element(d.get(), p99, d.get() + size);
-      uint8_t minv = *p01, maxv = *p99;
+      // out of core, intensities of the middle slice stand for the volume
+      storage<uint8_t> middle;
+      if (m_scans[i].out_of_core)
+      {
+        size = m_scans[i].width * m_scans[i].height;
+        middle = storage<uint8_t>(size);
+        try
+        {
+          source->read(m_scans[i].depth / 2, 0, 0, image_view<uint8_t>(middle.data(), m_scans[i].width, m_scans[i].height));
+        }
+        catch (exception &)
+        {
+          size = 0;
+        }
+      }
+
+      glGenTextures(1, &m_scans[i].tx);
+      if (m_scans[i].progress)
+      {
+        // slices and intensity mapping follow as slices are decoded
+        storage<uint8_t> d(size);
+        fill_n(d.data(), size, uint8_t(0));
+        glBindTexture(GL_TEXTURE_3D, m_scans[i].tx);
+        glTexImage3D(GL_TEXTURE_3D, 0, GL_LUMINANCE, m_scans[i].width, m_scans[i].height, m_scans[i].depth, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, d.data());
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        continue;
+      }
+
+      const uint8_t *t = m_scans[i].out_of_core ? middle.data() : scans[i].first->tomogram.data();
+      make_lut(m_scans[i].lut, t, size);
+      const uint8_t *lut = m_scans[i].lut;
+
+      if (m_scans[i].out_of_core)
+      {
+        // slices are uploaded when shown
+        glBindTexture(GL_TEXTURE_2D, m_scans[i].tx);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        continue;
+      }
 
-      // turn image negative and maximize contrast
+      storage<uint8_t> d(size);
       for (size_t k = 0; k != size; ++k)
-        d[k] = uint8_t(numeric_limits<uint8_t>::max() * min(1.0, max(0.0, (1.0 - double(scans[i].first->tomogram.data()[k] - minv) / (maxv - minv)))));
+        d.data()[k] = lut[t[k]];
 
       // load volume data
-      glGenTextures(1, &m_scans[i].tx);
       glBindTexture(GL_TEXTURE_3D, m_scans[i].tx);
-      glTexImage3D(GL_TEXTURE_3D, 0, GL_LUMINANCE, m_scans[i].width, m_scans[i].height, m_scans[i].depth, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, d.get());
+      glTexImage3D(GL_TEXTURE_3D, 0, GL_LUMINANCE, m_scans[i].width, m_scans[i].height, m_scans[i].depth, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, d.data());
       glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
       glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     }
@@ -87,6 +150,8 @@ struct render_slice
   {
     for (size_t i = 0; i != m_scans.size(); ++i)
       glDeleteTextures(1, &m_scans[i].tx);
+    for (auto &t: m_tiles)
+      glDeleteTextures(1, &t.second.tx);
   }
 
   void paint(const std::function<void (int, int, const char *)> &draw_text) override
@@ -99,27 +164,57 @@ struct render_slice
     glScaled(s, s, s);
     glTranslated(m_cx, m_cy, 0.0);
 
+    for (size_t i = 0; i != m_scans.size(); ++i)
+      upload_slices(i);
+
     const scan &p = m_scans[m_demux];
+    const bool loading = p.progress && !p.uploaded[*p.slice];
 
     // correct aspect ratio and ensure image is inside [-1.0,1.0]x[-1.0,1.0]
     double h = min(m_view_width / (p.aspect * m_view_height), 1.0);
     double w = p.aspect * h;
 
     // draw image
-    glBindTexture(GL_TEXTURE_3D, p.tx);
-    glEnable(GL_TEXTURE_3D);
-    glColor4d(1.0, 1.0, 1.0, 1.0);
-    glBegin(GL_QUADS);
-    glTexCoord3d(0.0, 0.0, (*p.slice+0.5)/p.depth);
-    glVertex2d(-w,  h);
-    glTexCoord3d(1.0, 0.0, (*p.slice+0.5)/p.depth);
-    glVertex2d( w,  h);
-    glTexCoord3d(1.0, 1.0, (*p.slice+0.5)/p.depth);
-    glVertex2d( w, -h);
-    glTexCoord3d(0.0, 1.0, (*p.slice+0.5)/p.depth);
-    glVertex2d(-w, -h);
-    glEnd();
-    glDisable(GL_TEXTURE_3D);
+    if (p.out_of_core)
+    {
+      load_slice(m_demux);
+      glBindTexture(GL_TEXTURE_2D, p.tx);
+      glEnable(GL_TEXTURE_2D);
+      glColor4d(1.0, 1.0, 1.0, 1.0);
+      glBegin(GL_QUADS);
+      glTexCoord2d(0.0, 0.0);
+      glVertex2d(-w,  h);
+      glTexCoord2d(1.0, 0.0);
+      glVertex2d( w,  h);
+      glTexCoord2d(1.0, 1.0);
+      glVertex2d( w, -h);
+      glTexCoord2d(0.0, 1.0);
+      glVertex2d(-w, -h);
+      glEnd();
+      glDisable(GL_TEXTURE_2D);
+    }
+    else if (!loading)
+    {
+      glBindTexture(GL_TEXTURE_3D, p.tx);
+      glEnable(GL_TEXTURE_3D);
+      glColor4d(1.0, 1.0, 1.0, 1.0);
+      glBegin(GL_QUADS);
+      glTexCoord3d(0.0, 0.0, (*p.slice+0.5)/p.depth);
+      glVertex2d(-w,  h);
+      glTexCoord3d(1.0, 0.0, (*p.slice+0.5)/p.depth);
+      glVertex2d( w,  h);
+      glTexCoord3d(1.0, 1.0, (*p.slice+0.5)/p.depth);
+      glVertex2d( w, -h);
+      glTexCoord3d(0.0, 1.0, (*p.slice+0.5)/p.depth);
+      glVertex2d(-w, -h);
+      glEnd();
+      glDisable(GL_TEXTURE_3D);
+    }
+
+    // draw full resolution tiles when zoomed in beyond the reduced tomogram,
+    // full resolution tomograms keep their slices when decoded progressively
+    if (p.source && p.reduced && !p.out_of_core && s * w * m_view_height > p.width)
+      draw_tiles(m_demux, s, w, h);
 
     // draw contours
     glLineWidth(3.0 * s);
@@ -171,6 +266,195 @@ struct render_slice
     draw_text(5, m_view_height - 5, os.str().c_str());
     draw_text(5, 15, p.laterality == "L" ? "N" : p.laterality == "R" ? "T" : "");
     draw_text(m_view_width - 15, 15, p.laterality == "L" ? "T" : p.laterality == "R" ? "N" : "");
+    if (loading)
+      draw_text(m_view_width / 2 - 30, m_view_height / 2, "loading...");
+  }
+
+  /// map intensities to maximize contrast, from a histogram of the given voxels
+  static void make_lut(uint8_t *lut, const uint8_t *t, size_t size)
+  {
+    // find min and max intensity value, discard upper and lower 1% as outliers
+    size_t histogram[256] = {};
+    for (size_t k = 0; k != size; ++k)
+      ++histogram[t[k]];
+
+    auto percentile = [&](size_t n)
+    {
+      size_t v = 0;
+      for (size_t sum = histogram[0]; sum <= n && v != 255; sum += histogram[++v]);
+      return uint8_t(v);
+    };
+    uint8_t minv = percentile(size / 100), maxv = percentile(size - (size + 99) / 100);
+
+    // turn image negative and maximize contrast
+    for (size_t k = 0; k != 256; ++k)
+      lut[k] = uint8_t(numeric_limits<uint8_t>::max() * min(1.0, max(0.0, (1.0 - double(uint8_t(k) - minv) / (maxv - minv)))));
+  }
+
+  /// upload slices of a progressively loaded tomogram decoded since the last call
+  void upload_slices(size_t i)
+  {
+    scan &p = m_scans[i];
+    if (!p.progress)
+      return;
+
+    // the middle slice is decoded first and gives the intensity mapping
+    const size_t n = p.width * p.height;
+    if (!p.lut_ready)
+    {
+      if (!p.progress->ready(p.depth / 2))
+        return;
+      make_lut(p.lut, p.data + p.depth / 2 * n, n);
+      p.lut_ready = true;
+    }
+
+    storage<uint8_t> d;
+    for (size_t z = 0; z != p.depth; ++z)
+    {
+      if (p.uploaded[z] || !p.progress->ready(z))
+        continue;
+
+      if (!d.data())
+        d = storage<uint8_t>(n);
+      for (size_t k = 0; k != n; ++k)
+        d.data()[k] = p.lut[p.data[z * n + k]];
+
+      glBindTexture(GL_TEXTURE_3D, p.tx);
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+      glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, z, p.width, p.height, 1, GL_LUMINANCE, GL_UNSIGNED_BYTE, d.data());
+      p.uploaded[z] = true;
+    }
+
+    // decoding done, stop checking
+    if (p.progress->done() && find(p.uploaded.begin(), p.uploaded.end(), false) == p.uploaded.end())
+      p.progress.reset();
+  }
+
+  /// upload current slice of an out of core tomogram if not done yet
+  void load_slice(size_t i)
+  {
+    scan &p = m_scans[i];
+    if (p.loaded == *p.slice || *p.slice >= p.depth)
+      return;
+
+    storage<uint8_t> d(p.width * p.height);
+    try
+    {
+      p.source->read(*p.slice, 0, 0, image_view<uint8_t>(d.data(), p.width, p.height));
+    }
+    catch (exception &)
+    {
+      return;
+    }
+
+    for (size_t k = 0; k != p.width * p.height; ++k)
+      d.data()[k] = p.lut[d.data()[k]];
+
+    glBindTexture(GL_TEXTURE_2D, p.tx);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, p.width, p.height, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, d.data());
+    p.loaded = *p.slice;
+  }
+
+  /// draw visible tiles of the current slice from the slice source
+  void draw_tiles(size_t i, double s, double w, double h)
+  {
+    const scan &p = m_scans[i];
+    const size_t width = p.source->width(), height = p.source->height();
+
+    // visible part of the image in texture coordinates
+    const double a = double(m_view_width) / m_view_height;
+    const double u0 = max(0.0, (-a / s - m_cx + w) / (2.0 * w)), u1 = min(1.0, (a / s - m_cx + w) / (2.0 * w));
+    const double v0 = max(0.0, (h - 1.0 / s + m_cy) / (2.0 * h)), v1 = min(1.0, (h + 1.0 / s + m_cy) / (2.0 * h));
+    if (u0 >= u1 || v0 >= v1)
+      return;
+
+    const size_t tx0 = size_t(u0 * width) / tile_size, tx1 = (size_t(ceil(u1 * width)) + tile_size - 1) / tile_size;
+    const size_t ty0 = size_t(v0 * height) / tile_size, ty1 = (size_t(ceil(v1 * height)) + tile_size - 1) / tile_size;
+    if ((tx1 - tx0) * (ty1 - ty0) > max_tiles)
+      return;
+
+    glEnable(GL_TEXTURE_2D);
+    glColor4d(1.0, 1.0, 1.0, 1.0);
+    for (size_t ty = ty0; ty != ty1; ++ty)
+      for (size_t tx = tx0; tx != tx1; ++tx)
+      {
+        const tile *t = get_tile(i, *p.slice, tx, ty);
+        if (!t)
+        {
+          glDisable(GL_TEXTURE_2D);
+          return;
+        }
+
+        const double x0 = (2.0 * tx * tile_size / width - 1.0) * w, x1 = (2.0 * (tx * tile_size + t->width) / width - 1.0) * w;
+        const double y0 = (1.0 - 2.0 * ty * tile_size / height) * h, y1 = (1.0 - 2.0 * (ty * tile_size + t->height) / height) * h;
+        glBindTexture(GL_TEXTURE_2D, t->tx);
+        glBegin(GL_QUADS);
+        glTexCoord2d(0.0, 0.0);
+        glVertex2d(x0, y0);
+        glTexCoord2d(1.0, 0.0);
+        glVertex2d(x1, y0);
+        glTexCoord2d(1.0, 1.0);
+        glVertex2d(x1, y1);
+        glTexCoord2d(0.0, 1.0);
+        glVertex2d(x0, y1);
+        glEnd();
+      }
+    glDisable(GL_TEXTURE_2D);
+  }
+
+  /// give cached tile or decode it, null if decoding fails
+  const tile *get_tile(size_t i, size_t z, size_t tx, size_t ty)
+  {
+    const tile_key key(i, z, tx, ty);
+    auto it = m_tiles.find(key);
+    if (it != m_tiles.end())
+    {
+      m_tile_order.splice(m_tile_order.begin(), m_tile_order, it->second.order);
+      return &it->second;
+    }
+
+    scan &p = m_scans[i];
+    const size_t x = tx * tile_size, y = ty * tile_size;
+    const size_t width = min(tile_size, p.source->width() - x), height = min(tile_size, p.source->height() - y);
+    storage<uint8_t> d(width * height);
+    try
+    {
+      p.source->read(z, x, y, image_view<uint8_t>(d.data(), width, height));
+    }
+    catch (exception &)
+    {
+      // show the reduced tomogram only
+      p.source.reset();
+      return nullptr;
+    }
+
+    for (size_t k = 0; k != width * height; ++k)
+      d.data()[k] = p.lut[d.data()[k]];
+
+    // drop least recently used tile
+    if (m_tiles.size() == max_tiles)
+    {
+      auto last = m_tiles.find(m_tile_order.back());
+      glDeleteTextures(1, &last->second.tx);
+      m_tiles.erase(last);
+      m_tile_order.pop_back();
+    }
+
+    m_tile_order.push_front(key);
+    tile &t = m_tiles[key];
+    t.width = width;
+    t.height = height;
+    t.order = m_tile_order.begin();
+    glGenTextures(1, &t.tx);
+    glBindTexture(GL_TEXTURE_2D, t.tx);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, width, height, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, d.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    return &t;
   }
 
   void resize(size_t width, size_t height) override
@@ -236,8 +520,20 @@ struct render_slice
     string laterality;
     observable<size_t> *slice;
     unique_ptr<observer> slice_observer;
+    shared_ptr<slice_source> source; ///< full resolution slices, if available
+    bool out_of_core; ///< tomogram not loaded, slices come from source
+    bool reduced; ///< tomogram at reduced resolution, source has more detail
+    size_t loaded; ///< slice in the 2d texture if out of core
+    shared_ptr<const progressive_tomogram> progress; ///< decoding tomogram, null when all slices are uploaded
+    const uint8_t *data; ///< tomogram voxels
+    vector<bool> uploaded; ///< slices in the 3d texture while decoding
+    bool lut_ready; ///< intensity mapping known while decoding
+    uint8_t lut[256]; ///< intensity mapping
   };
 
+  map<tile_key, tile> m_tiles; ///< decoded tiles
+  list<tile_key> m_tile_order; ///< tiles from most to least recently used
+
   vector<scan> m_scans;
   vector<bool> m_visible;
   observable<size_t> &m_demux;